@@ -1,7 +1,30 @@
 #include <iostream>         
 #include <cstdlib>         
+#include <cstring>
+#include <cstdio>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <unordered_map>
+#include <cstdint>
+#include <string>
+#include <cmath>
+#include <cfloat>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <cassert>
 #include <GL/glew.h>       
 #include <GLFW/glfw3.h>     
+
+// Build agents without a display create their context through EGL (Mesa surfaceless platform)
+#if defined(__linux__)
+#define UHEADLESS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #define STB_IMAGE_IMPLEMENTATION
 #include <stb_image.h> 
 
@@ -11,6 +34,18 @@
 
 #include <camera.h>
 
+// SIMD image kernels: AVX2 and SSSE3 when the compiler targets them, SSE2 on every x86-64 build, scalar elsewhere
+#if defined(__AVX2__)
+#define USIMD_AVX2
+#endif
+#if defined(__SSSE3__) || defined(__AVX2__)
+#define USIMD_SSSE3
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USIMD_SSE2
+#include <immintrin.h>
+#endif
+
 using namespace std;
 
 /*Shader program Macro*/
@@ -18,6 +53,9 @@ using namespace std;
 #define GLSL(Version, Source) "#version " #Version " core \n" #Source
 #endif
 
+// GLSL shared between shaders, inserted after their #version line
+#define GLSL_SHARED(Source) #Source "\n"
+
 // Unnamed namespace
 namespace
 {
@@ -27,45 +65,513 @@ namespace
     const int WINDOW_WIDTH = 1000;
     const int WINDOW_HEIGHT = 800;
 
-    // Stores the GL data relative to a given mesh
-    struct GLMesh
-    {
-        GLuint vao;         // Handle for the vertex array object
-        GLuint vbo;         // Handle for the vertex buffer object
-        GLuint nVertices;   // Number of indices of the mesh
-    };
-
+    // Stores the GL data relative to a given mesh. The buffers belong to the shared mesh arena.
     struct GLDoubleMesh
     {
         GLuint vao;         // Handle for the vertex array object
         GLuint vbos[2];     // Handles for the vertex buffer objects
         GLuint nIndices;    // Number of indices of the mesh
+        GLuint nVertices;   // Number of unique vertices after welding
+        GLuint firstIndex;  // Offset of the mesh's indices in the arena index buffer
+        GLint baseVertex;   // Offset of the mesh's vertices in the arena vertex buffer
+        GLuint arenaId;     // Creation order within the arena, used in render queue sort keys
+        glm::vec3 boundsMin;    // Object-space AABB of the vertex positions
+        glm::vec3 boundsMax;
+        glm::vec3 sphereCenter; // Sphere around the AABB, tested by the frustum culler
+        float sphereRadius;
+    };
+
+    // Every mesh is sub-allocated from one vertex buffer and one index buffer behind a single VAO
+    struct MeshArena
+    {
+        GLuint vao;
+        GLuint vertexBuffer;
+        GLuint indexBuffer;
+        GLuint vertexCount;       // Vertices in use
+        GLuint vertexCapacity;
+        GLuint indexCount;        // Indices in use
+        GLuint indexCapacity;
+        GLuint meshCount;
+    };
+
+    MeshArena gMeshArena;
+
+    // Every mesh uses the same interleaved layout: position, normal, texture coordinate
+    const GLuint FLOATS_PER_VERTEX = 3 + 3 + 2;
+
+    // One interleaved vertex compared bit for bit when welding
+    struct VertexKey
+    {
+        GLfloat values[FLOATS_PER_VERTEX];
+
+        bool operator==(const VertexKey& other) const
+        {
+            return memcmp(values, other.values, sizeof(values)) == 0;
+        }
+    };
+
+    struct VertexKeyHash
+    {
+        size_t operator()(const VertexKey& key) const
+        {
+            // FNV-1a over the raw float bits
+            const unsigned char* bytes = reinterpret_cast<const unsigned char*>(key.values);
+            size_t hash = 2166136261u;
+            for (size_t i = 0; i < sizeof(key.values); ++i)
+                hash = (hash ^ bytes[i]) * 16777619u;
+            return hash;
+        }
     };
 
     // Main GLFW window
     GLFWwindow* gWindow = nullptr;
 
-    GLMesh lMesh;
-    GLMesh planeMesh;
-    GLMesh wandBoxMesh;
-    GLMesh pagesMesh;
-    GLMesh bookCoverMesh;
-    GLMesh cylinderMesh;
-    GLMesh mugMesh;
-
-    // Textures
-    GLuint bookCoverTexture;
-    GLuint bookPagesTexture;
-    GLuint greenLeatherTexture;
-    GLuint woodFloorTexture;
-    GLuint wandWoodTexture;
-    GLuint mugTexture;
+    // Size of the frame being rendered; follows the window's framebuffer, fixed when headless
+    int gFramebufferWidth = WINDOW_WIDTH;
+    int gFramebufferHeight = WINDOW_HEIGHT;
+
+    // Shape of a generated cylinder, tapered cup or mug
+    struct CylinderParams
+    {
+        int segments;          // Sides around the y axis
+        float bottomRadius;
+        float topRadius;       // Differs from bottomRadius for a tapered shape
+        float height;
+        bool bottomCap;
+        bool topCap;
+        bool handle;           // Half-ring handle on the +x side
+    };
+
+    // One primitive generated at several tessellations, finest level first
+    const int MAX_LODS = 4;
+
+    // A level is used while the object's projected diameter (in pixels) is at least its threshold
+    const float LOD_SCREEN_THRESHOLDS[MAX_LODS] = { 120.0f, 40.0f, 12.0f, 0.0f };
+
+    struct LodMesh
+    {
+        GLDoubleMesh levels[MAX_LODS];
+        int levelCount;
+        float radius;          // Largest radius around the axis, drives the projected size
+        float height;
+    };
+
+    GLDoubleMesh lMesh;
+    GLDoubleMesh planeMesh;
+    GLDoubleMesh wandBoxMesh;
+    GLDoubleMesh pagesMesh;
+    GLDoubleMesh bookCoverMesh;
+    LodMesh cylinderLods;
+    LodMesh mugLods;
+
+    // Materials (indices into gMaterials)
+    GLuint bookCoverMaterial;
+    GLuint bookPagesMaterial;
+    GLuint greenLeatherMaterial;
+    GLuint woodFloorMaterial;
+    GLuint wandWoodMaterial;
+    GLuint mugMaterial;
+
+    // A material is one layer of a texture array; same-sized textures share an array,
+    // so draws with different materials can still go out in one multi-draw
+    struct Material
+    {
+        GLuint textureArray;    // GL_TEXTURE_2D_ARRAY holding the image
+        GLuint layer;           // Layer of the image in that array
+        GLuint arrayIndex;      // Slot of the array in gTextureArrays; dense, so it fits the render queue sort key
+    };
+
+    // Used by draws that do not sample a texture (the light cube)
+    const GLuint NO_MATERIAL = 0xFFFFFFFF;
+
+    std::vector<Material> gMaterials;
+    std::vector<GLuint> gTextureArrays;
+
+    // Texture registered by ULoadMaterial; decoded on the worker pool by UBuildTextureArrays
+    struct TextureJob
+    {
+        std::string filename;
+        GLuint material;
+        int width;
+        int height;
+        GLenum format;          // GL_RGBA8, or a BC1/BC3 format holding every mip level
+        size_t stagingOffset;   // Byte offset of the texel data in the staging PBO
+        size_t stagingBytes;
+        bool decoded;
+        bool cached;            // Compressed levels came from the on-disk cache
+    };
+
+    // Header of the block-compressed cache file written next to each source image (<source>.bct)
+    struct TextureCacheHeader
+    {
+        char magic[4];          // "UBCT"
+        uint32_t version;
+        uint64_t sourceHash;    // FNV-1a of the source file bytes; a mismatch means the source changed
+        uint32_t format;
+        uint32_t width;
+        uint32_t height;
+        uint32_t levels;
+    };
+
+    const uint32_t TEXTURE_CACHE_VERSION = 1;
+
+    bool gHasS3tc = false;              // GL_EXT_texture_compression_s3tc (BC1/BC3) available
+
+    // Linked program binaries are cached on disk as <SHADER_CACHE_PREFIX><key>.bin
+    struct ProgramCacheHeader
+    {
+        char magic[4];          // "UPGB"
+        uint32_t version;
+        uint64_t key;           // Hash of both sources and the driver strings
+        uint32_t binaryFormat;
+        uint32_t length;
+    };
+
+    const char* const SHADER_CACHE_PREFIX = "./shader_cache_";
+    const uint32_t PROGRAM_CACHE_VERSION = 1;
+
+    bool gHasProgramBinary = false;     // Driver exposes at least one program binary format
+
+    // --image-benchmark: time the image kernels against the scalar path and exit
+    bool gImageBenchmark = false;
+    const int IMAGE_BENCHMARK_SIZE = 2048;
+    const int IMAGE_BENCHMARK_RUNS = 5;
+
+    std::vector<TextureJob> gTextureJobs;
+
+    // Shared between the decode workers and the uploading main thread
+    unsigned char* gTextureStaging = nullptr;  // Persistently mapped staging PBO
+    std::atomic<size_t> gNextTextureJob(0);
+    std::vector<size_t> gFinishedTextureJobs;
+    std::mutex gTextureJobMutex;
+    std::condition_variable gTextureJobReady;
 
     GLint gTexWrapMode = GL_REPEAT;
 
     // Shader program
     GLuint gProgramId;
     GLuint gLightProgramId;
+    GLuint gFallbackProgramId;  // Flat grey; drawn with while the other programs are still compiling
+
+    // Programs are compiled and linked in the background; state is polled the first time a draw needs them
+    enum ProgramState
+    {
+        PROGRAM_COMPILING,
+        PROGRAM_READY,
+        PROGRAM_FAILED
+    };
+
+    struct ShaderProgram
+    {
+        GLuint program;
+        GLuint vertexShader;    // Attached until the link is resolved; 0 when loaded from a binary
+        GLuint fragmentShader;
+        std::string vertexSource;   // Kept to recompile if the driver rejects a cached binary
+        std::string fragmentSource;
+        uint64_t cacheKey;
+        bool fromBinary;
+        ProgramState state;
+    };
+
+    std::vector<ShaderProgram> gShaderPrograms;
+    std::vector<GLuint> gDrawPrograms;      // Indexed by program id: the program to draw with, resolved once per frame
+    std::vector<GLuint> gProgramSortIndices;    // Indexed by program id: creation slot, dense for render queue sort keys
+    bool gHasParallelShaderCompile = false; // GL_KHR_parallel_shader_compile available
+
+    // Camera and cluster data shared by every program, uploaded once per frame (std140 block FrameData)
+    struct FrameUniforms
+    {
+        glm::mat4 view;
+        glm::mat4 projection;
+        glm::vec4 viewPosition;     // xyz used
+        glm::vec4 ambientColor;     // rgb used
+        glm::vec4 clusterScale;     // Log-depth slice scale and bias, tile width and height in pixels
+        glm::uvec4 clusterCount;    // Tiles across, tiles down, depth slices
+        glm::mat4 inverseViewProjection;    // Rebuilds world positions from depth in the deferred lighting pass
+        glm::mat4 shadowViewProjection;     // World to the side light's shadow map
+        glm::vec4 shadowParams;             // x: 1 when the side light is shadowed
+    };
+
+    const GLuint FRAME_UBO_BINDING = 0;
+    GLuint gFrameUbo;
+
+    const float NEAR_PLANE = 0.1f;
+    const float FAR_PLANE = 100.0f;
+
+    // Point light, std430 LightBuffer at shader storage binding 2
+    struct PointLight
+    {
+        glm::vec4 positionRadius;   // World position, distance where the light fades to zero
+        glm::vec4 colorFalloff;     // Color times intensity, quadratic distance attenuation
+    };
+
+    // Clustered forward shading: the view frustum is split into screen tiles and exponential depth slices, and
+    // every cluster lists the lights whose sphere reaches it. The fragment shader only loops over its cluster
+    const int CLUSTER_TILES_X = 16;
+    const int CLUSTER_TILES_Y = 8;
+    const int CLUSTER_SLICES = 24;
+    const int CLUSTER_COUNT = CLUSTER_TILES_X * CLUSTER_TILES_Y * CLUSTER_SLICES;
+
+    const GLuint LIGHT_SSBO_BINDING = 2;
+    const GLuint CLUSTER_SSBO_BINDING = 3;      // uvec2 (first index, light count) per cluster
+    const GLuint LIGHT_INDEX_SSBO_BINDING = 4;  // Light indices of all clusters, back to back
+
+    std::vector<PointLight> gLights;
+    std::vector<glm::vec3> gLightColors;    // Unflickered color times intensity of each light
+    std::vector<float> gLightFlicker;       // Per-light flicker phase; 0 for steady lights
+    std::vector<int> gLightTransforms;      // Lamp cube drawn at each scattered light
+    int gLightCount = 0;                    // --lights N scatters N candles around the desk
+    float gLightTime = 0.0f;
+
+    GLuint gLightBuffer = 0;
+    GLuint gClusterBuffer = 0;
+    GLuint gLightIndexBuffer = 0;
+    size_t gLightCapacity = 0;              // In lights
+    size_t gLightIndexCapacity = 0;         // In indices
+
+    // Cluster range covered by each light this frame, then the per-cluster lists built from them
+    struct LightClusterRange
+    {
+        int minX, maxX;
+        int minY, maxY;
+        int minSlice, maxSlice;
+    };
+    std::vector<LightClusterRange> gLightRanges;
+    std::vector<glm::uvec2> gClusters;
+    std::vector<GLuint> gLightIndices;
+
+    // Per-instance data, std430 InstanceBuffer at shader storage binding 0
+    struct InstanceData
+    {
+        glm::mat4 model;
+        glm::vec4 normalMatrix[3];  // Inverse transpose of the model's upper 3x3, as std430 mat3 columns
+        glm::vec4 uvScale;          // xy used, padded to the std430 struct alignment
+    };
+
+    // Layout of one glMultiDrawElementsIndirect command
+    struct DrawElementsIndirectCommand
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    // Per-draw data, std430 DrawBuffer at shader storage binding 1, indexed with gl_DrawID
+    struct DrawData
+    {
+        GLuint firstInstance;   // First InstanceData of the command
+        GLuint layer;           // Texture array layer of the command's material
+    };
+
+    // Consecutive indirect commands that share program and texture array, issued as one multi-draw
+    struct MultiDrawBatch
+    {
+        GLuint program;
+        GLuint textureArray;
+        GLuint firstCommand;
+        GLuint commandCount;
+    };
+
+    const GLuint INSTANCE_SSBO_BINDING = 0;
+    const GLuint DRAW_SSBO_BINDING = 1;
+
+    GLuint gInstanceBuffer;             // InstanceData per queued draw, in sorted order
+    GLuint gDrawBuffer;                 // DrawData of every indirect command, read with gl_DrawID
+    GLuint gIndirectBuffer;             // DrawElementsIndirectCommand per mesh run
+    size_t gInstanceCapacity;           // In instances
+    size_t gCommandCapacity;            // In commands
+    bool gHasDrawParameters = false;    // GL_ARB_shader_draw_parameters (gl_DrawIDARB) available
+
+    std::vector<DrawElementsIndirectCommand> gIndirectCommands;
+    std::vector<DrawData> gDrawData;
+    std::vector<MultiDrawBatch> gMultiDrawBatches;
+
+    // One queued draw. The 64-bit key orders the queue by state so binds only change between runs:
+    // program (8 bits) | texture array (8) | mesh (12) | layer (8) | view depth, front to back (24) | unused (4)
+    struct RenderPacket
+    {
+        uint64_t key;
+        GLuint program;
+        GLuint material;
+        const GLDoubleMesh* mesh;
+        InstanceData instance;
+    };
+
+    // Key plus packet index, the only thing the radix sort moves around
+    struct SortEntry
+    {
+        uint64_t key;
+        uint32_t packet;
+    };
+
+    std::vector<RenderPacket> gRenderQueue;
+    std::vector<SortEntry> gSortEntries;
+    std::vector<SortEntry> gSortScratch;
+    std::vector<InstanceData> gSortedInstances;
+
+    // Frustum culling of the queue: world-space bounding spheres of the packets as SoA arrays, padded to 8 lanes
+    bool gFrustumCulling = true;
+    std::vector<float> gCullX;
+    std::vector<float> gCullY;
+    std::vector<float> gCullZ;
+    std::vector<float> gCullRadius;
+    std::vector<uint8_t> gCullVisible;
+    size_t gCulledCount = 0;            // Packets rejected in the last executed queue
+
+    // Everything drawn in the scene, registered with the BVH by UAddSceneObject: the desk objects and lamp cubes
+    // (which follow an entry of the transform store) and any --props
+    struct SceneObject
+    {
+        const char* name;       // Reported by picking
+        int transform;          // Transform store entry the object follows, -1 for props placed by matrix
+        bool castsShadow;       // False for the lamp cubes, which would cover their own light
+        GLuint program;
+        const GLDoubleMesh* mesh;
+        const LodMesh* lods;    // When set, the level is picked each frame by screen size instead of mesh
+        GLuint material;
+        glm::mat4 model;
+        glm::mat3 normalMatrix; // Cached with the model so static props do no matrix work per frame
+        glm::vec2 uvScale;
+        glm::vec3 boundsMin;    // World-space AABB
+        glm::vec3 boundsMax;
+        int leaf;               // BVH node holding the object
+        bool dynamic;           // Moved at least once; cast into the shadow map per frame instead of cached
+    };
+
+    // Node of the scene BVH; every leaf holds exactly one object
+    struct BvhNode
+    {
+        glm::vec3 boundsMin;
+        glm::vec3 boundsMax;
+        int parent;
+        int left;               // Children, -1 for leaves
+        int right;
+        int object;             // Object index for leaves, -1 for inner nodes
+    };
+
+    std::vector<SceneObject> gSceneObjects;
+    std::vector<BvhNode> gBvhNodes;
+    int gBvhRoot = -1;
+    bool gBvhDirty = false;             // Objects were added since the last build; the next query rebuilds
+    std::vector<int> gBvhStack;         // Traversal stack shared by the queries
+    std::vector<int> gSceneQueryResults;
+    std::vector<int> gTransformSceneObjects;    // Indexed by transform: the scene object following it, or -1
+    int gPropCount = 0;                 // --props N scatters N extra props around the desk
+
+    // Transform store, one entry per placed object in structure-of-arrays form. World matrices are cached and
+    // only rebuilt for dirty entries (and their children); a parent always has a lower index than its children
+    struct TransformStore
+    {
+        std::vector<glm::vec3> position;
+        std::vector<glm::vec3> rotationAxis;
+        std::vector<float> rotationAngle;   // Radians about rotationAxis
+        std::vector<glm::vec3> scale;
+        std::vector<int> parent;            // -1 for roots
+        std::vector<glm::mat4> world;
+        std::vector<glm::mat3> normalMatrix;    // Inverse transpose of world, for the instance buffer
+        std::vector<uint8_t> dirty;
+        size_t dirtyCount = 0;
+    };
+
+    TransformStore gTransforms;
+    size_t gTransformsRebuilt = 0;      // World matrices recomputed by the last UUpdateTransforms
+    std::vector<int> gRebuiltTransforms;    // Their indices, for the scene objects that follow them
+
+    // Desk objects
+    int gLightTransform = -1;
+    int gPlaneTransform = -1;
+    int gWandboxTransform = -1;
+    int gCoverTransform = -1;
+    int gPagesTransform = -1;
+    int gWandTransform = -1;            // Shared placement of the three wand parts below
+    int gWandPartTransforms[3] = { -1, -1, -1 };
+    int gMugTransform = -1;
+
+    // Side light shadow map. Static casters are rendered into a cached map only when they or the light change;
+    // each frame that has moving casters copies it and draws just those on top
+    bool gShadows = true;
+    const GLsizei SHADOW_MAP_SIZE = 2048;
+    const GLuint SHADOW_TEXTURE_UNIT = 4;
+    const float SHADOW_FAR_PLANE = 30.0f;   // Range of the side light's shadow projection
+    GLuint gShadowProgramId = 0;
+    GLuint gStaticShadowMap = 0;        // DEPTH_COMPONENT32F, static casters only
+    GLuint gStaticShadowFbo = 0;
+    GLuint gShadowMap = 0;              // Static map plus this frame's moving casters
+    GLuint gShadowFbo = 0;
+    bool gShadowStaticDirty = true;
+    glm::vec3 gShadowLightPosition;     // Light position the cached map was rendered from
+    std::vector<int> gDynamicSceneObjects;
+    size_t gStaticShadowRenders = 0;    // Times the cached map was re-rendered
+
+    // --animate spins the wand, so its parts become moving casters composited over the cached shadow map
+    bool gAnimate = false;
+    std::chrono::steady_clock::time_point gAnimationStart;
+    float gWandBaseAngle = 0.0f;        // The wand's placed rotation, which the animation turns from
+
+    // Depth pre-pass (--depth-prepass) and overdraw view (--overdraw), applied to the camera pass of the queue
+    bool gDepthPrepass = false;
+    bool gOverdrawView = false;
+    GLuint gDepthProgramId = 0;         // Position-only program writing depth for the GL_EQUAL shading pass
+    GLuint gOverdrawProgramId = 0;      // Additive constant color in place of shading
+    GLuint gOverdrawQuery = 0;          // GL_SAMPLES_PASSED over the shading pass: fragments shaded
+    bool gOverdrawQueryIssued = false;
+
+    // Deferred shading (--deferred): the geometry pass writes albedo, an octahedral normal and depth, 12 bytes per
+    // pixel, and a full-screen pass runs the clustered lighting once per visible pixel
+    bool gDeferred = false;
+    GLuint gGBufferFbo = 0;
+    GLuint gGBufferAlbedo = 0;          // RGBA8; alpha 1 marks unlit pixels (light cubes, fallback program)
+    GLuint gGBufferNormal = 0;          // RG16 octahedral-packed world normal
+    GLuint gGBufferDepth = 0;           // DEPTH24_STENCIL8, sampled to rebuild world positions
+    GLuint gDeferredLightingProgramId = 0;
+    GLuint gFullScreenVao = 0;          // Attribute-less; the full-screen triangle comes from gl_VertexID
+
+    // Hi-Z occlusion culling: each frame's depth is reduced on the GPU to a max-depth pyramid, and one coarse
+    // level is read back to test the next frame's bounding spheres on the CPU
+    struct HiZLevel
+    {
+        int width;
+        int height;
+        std::vector<float> depth;   // Farthest depth in each texel's footprint
+    };
+
+    bool gOcclusionCulling = true;
+    const int HIZ_READBACK_LEVEL = 2;   // GPU pyramid level copied to the CPU (1/8 of the frame per side)
+    GLuint gHiZProgramId = 0;
+    GLuint gHiZDepthTexture = 0;        // Copy of the frame's depth buffer; window depth cannot be sampled
+    GLuint gHiZDepthFbo = 0;
+    GLuint gHiZTexture = 0;             // R32F pyramid, level 0 at half the frame size
+    GLuint gHiZReadback = 0;            // Pixel pack buffer receiving HIZ_READBACK_LEVEL
+    GLsync gHiZFence = 0;               // Signals when the readback has landed
+    glm::mat4 gHiZPendingViewProjection;    // Camera of the depth in the readback buffer
+    glm::mat4 gHiZViewProjection;           // Camera of the depth in gHiZLevels
+    std::vector<HiZLevel> gHiZLevels;       // CPU pyramid from the read-back level down to 1x1
+    size_t gOccludedCount = 0;          // Packets rejected by the Hi-Z test in the last executed queue
+    size_t gDrawnCount = 0;             // Packets left after culling in the last executed queue
+
+    // Uniforms the draw code sets. Locations are looked up once per program when it is linked.
+    enum UniformId
+    {
+        UNIFORM_OBJECT_COLOR,
+        UNIFORM_TEXTURE,
+        UNIFORM_DRAW_ID_BASE,
+        UNIFORM_COUNT
+    };
+
+    const char* const UNIFORM_NAMES[UNIFORM_COUNT] = {
+        "objectColor", "uTexture", "drawIdBase"
+    };
+
+    // Active uniform locations of one program, -1 when the program does not use the uniform
+    struct ShaderReflection
+    {
+        GLint locations[UNIFORM_COUNT];
+    };
+
+    // Indexed by program id so the draw path never does a string lookup
+    std::vector<ShaderReflection> gShaderReflections;
 
     // Camera
     Camera gCamera(glm::vec3(0.0f, 1.5f, 7.0f)); // Default camera position
@@ -78,6 +584,84 @@ namespace
     float gDeltaTime = 0.0f; 
     float gLastFrame = 0.0f;
 
+    // Headless benchmark mode (--headless [--frames N])
+    bool gHeadless = false;
+    int gBenchmarkFrames = 300;
+
+    // --vertex-benchmark: GPU vertex-stage time of the mug and wand with CPU vs per-vertex normal matrices
+    bool gVertexBenchmark = false;
+    GLuint gInverseNormalProgramId;
+    const int VERTEX_BENCHMARK_INSTANCES = 256;
+    const int BENCHMARK_WARMUP_FRAMES = 10;
+
+    // Offscreen render target used when there is no window to draw into
+    GLuint gOffscreenFbo = 0;
+    GLuint gOffscreenColor = 0;
+    GLuint gOffscreenDepth = 0;
+
+    // Per-stage timing (--timing-csv path). Query results are read back
+    // TIMER_FRAME_LATENCY frames after they were issued so the CPU never waits on the GPU.
+    const int MAX_TIMED_STAGES = 32;
+    const int TIMER_FRAME_LATENCY = 2;
+
+    struct StageTiming
+    {
+        const char* name;   // Name of the timed draw function
+        GLuint query;       // GL_TIME_ELAPSED query object
+        double cpuMs;       // CPU time spent submitting the stage
+    };
+
+    struct TimingFrame
+    {
+        StageTiming stages[MAX_TIMED_STAGES];
+        int stageCount;     // Stages recorded this frame
+        long long frame;    // Frame number the stages belong to
+        bool pending;       // Results not yet written to the CSV
+    };
+
+    TimingFrame gTimingFrames[TIMER_FRAME_LATENCY];
+    const char* gTimingCsvPath = nullptr;
+    std::ofstream gTimingCsv;
+    bool gTimingEnabled = false;
+    long long gTimingFrame = 0;
+    std::chrono::steady_clock::time_point gStageStart;
+
+    // Frame pacing of the window loop: vsync, uncapped, or a fixed rate kept by sleeping until each deadline
+    enum PacingMode
+    {
+        PACING_VSYNC,
+        PACING_UNCAPPED,
+        PACING_FIXED
+    };
+
+    // One slot per frame the CPU may run ahead of the GPU. The fence caps frames in flight; the timestamp query
+    // says when the GPU got through the frame and its swap, for the input-to-photon estimate
+    struct FrameInFlight
+    {
+        GLsync fence;
+        GLuint timestampQuery;
+        double inputMs;     // Steady clock when the frame's input was sampled
+        bool pending;
+    };
+
+    const int MAX_FRAMES_IN_FLIGHT = 8;
+    const double LATENCY_REPORT_SECONDS = 5.0;
+
+    PacingMode gPacingMode = PACING_VSYNC;
+    double gTargetFps = 60.0;                   // PACING_FIXED only
+    int gFramesInFlight = 2;                    // --frames-in-flight N, at most MAX_FRAMES_IN_FLIGHT
+    FrameInFlight gFrameSlots[MAX_FRAMES_IN_FLIGHT];
+    long long gPacedFrame = 0;
+    std::chrono::steady_clock::time_point gNextFrameDeadline;
+    double gGpuClockOffsetMs = 0.0;             // Steady clock minus GL_TIMESTAMP, recalibrated with each report
+    double gLastLatencyReportMs = 0.0;
+    std::vector<double> gLatencySamples;        // Input-to-swap-completion, ms, since the last report
+
+#ifdef UHEADLESS_EGL
+    EGLDisplay gEglDisplay = EGL_NO_DISPLAY;
+    EGLContext gEglContext = EGL_NO_CONTEXT;
+#endif
+
     // Object color
     glm::vec3 gObjectColor(1.0f, 1.0f, 1.0f); 
 
@@ -91,32 +675,181 @@ namespace
 }
 
 bool UInitialize(int, char* [], GLFWwindow** window);
+void UParseCommandLine(int argc, char* argv[]);
+bool URunImageBenchmark();
+bool UCreateHeadlessContext();
+bool UCreateOffscreenTarget(int width, int height);
+void UDestroyHeadless();
+void URunFrameBenchmark(int frameCount);
+void URunVertexBenchmark();
+void UPresentFrame();
+void UInitFramePacing();
+double USteadyMs();
+void UCalibrateGpuClock();
+void UBeginPacedFrame();
+void UEndPacedFrame();
+void UResolveFrameInFlight(FrameInFlight& slot);
+void UReportLatency();
+void UDestroyFramePacing();
+bool UInitTiming(const char* csvPath);
+void UBeginTimingFrame();
+void UBeginStage(const char* name);
+void UEndStage();
+void UEndTimingFrame();
+void UResolveTimingFrame(TimingFrame& timingFrame);
+void UDestroyTiming();
 void UResizeWindow(GLFWwindow* window, int width, int height);
 void UProcessInput(GLFWwindow* window);
 void processView(GLFWwindow* window); 
 void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos);
 void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset);
 void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods);
-void createPlaneMesh(GLMesh& mesh);
-void createWandboxMesh(GLMesh& mesh);
-void createPagesMesh(GLMesh& mesh);
-void createBookCoverMesh(GLMesh& mesh);
-void createWandMesh(GLMesh& mesh);
-void createMugMesh(GLMesh& mesh);
-void UCreateLightMesh(GLMesh& mesh);
+void createPlaneMesh(GLDoubleMesh& mesh);
+void createWandboxMesh(GLDoubleMesh& mesh);
+void createPagesMesh(GLDoubleMesh& mesh);
+void createBookCoverMesh(GLDoubleMesh& mesh);
+void createWandMesh(LodMesh& lods);
+void createMugMesh(LodMesh& lods);
+void UGenerateCylinder(const CylinderParams& params, std::vector<GLfloat>& verts);
+void UGenerateBox(float width, float height, float depth, std::vector<GLfloat>& verts);
+void UCreateLodChain(CylinderParams params, const int* segmentCounts, int levelCount, LodMesh& lods);
+const GLDoubleMesh& USelectLod(const LodMesh& lods, const glm::mat4& model);
+void UDestroyLodMesh(LodMesh& lods);
+void UCreateLightMesh(GLDoubleMesh& mesh);
 void URender(); 
-void UDrawLightSources();
-void drawPlane(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle); 
-void drawWandbox(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle); 
-void drawPages(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle); 
-void drawCover(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle); 
-void drawWand(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle);
-void drawMug(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle);
-void UDestroyMesh(GLMesh& mesh);
-bool UCreateTexture(const char* filename, GLuint& textureId);
-void UDestroyTexture(GLuint textureId);
+int UCreateTransform(const glm::vec3& position, const glm::vec3& rotationAxis, float rotationAngle, const glm::vec3& scale, int parent);
+void UMarkTransformDirty(int transform);
+void USetTransformPosition(int transform, const glm::vec3& position);
+void USetTransformRotation(int transform, const glm::vec3& axis, float angle);
+void USetTransformScale(int transform, const glm::vec3& scale);
+void UUpdateTransforms();
+void UCreateSceneTransforms();
+void UDestroyMesh(GLDoubleMesh& mesh);
+void UCreateIndexedMesh(const GLfloat* verts, size_t floatCount, GLDoubleMesh& mesh);
+void UCreateMeshArena(GLuint vertexCapacity, GLuint indexCapacity);
+void UGrowArenaBuffer(GLuint& buffer, size_t usedBytes, size_t newBytes);
+void UDestroyMeshArena();
+std::string UAddDrawParameters(const std::string& shaderSource);
+std::string UAddInstanceInterface(const std::string& shaderSource);
+std::string UAddDefines(const std::string& shaderSource, const char* defines);
+bool ULoadMaterial(const char* filename, GLuint& materialId);
+GLsizei UTextureLevelCount(int width, int height);
+size_t UTextureLevelBytes(GLenum format, int width, int height);
+void UDownsampleRgba(const unsigned char* source, int width, int height, unsigned char* destination);
+void UDownsampleRgbaScalar(const unsigned char* source, int width, int height, unsigned char* destination);
+uint16_t UPack565(const int* rgb);
+void UUnpack565(uint16_t color, int* rgb);
+void UEncodeBc1Block(const unsigned char* texels, unsigned char* block);
+void UEncodeBc3AlphaBlock(const unsigned char* texels, unsigned char* block);
+void UEncodeBcLevel(GLenum format, const unsigned char* rgba, int width, int height, unsigned char* destination);
+bool UReadTextureCache(const TextureJob& job, uint64_t sourceHash, unsigned char* destination);
+void UWriteTextureCache(const TextureJob& job, uint64_t sourceHash, const unsigned char* data);
+void UDecodeTextureWorker();
+bool UBuildTextureArrays();
+void UDestroyTextureArrays();
 bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId);
 void UDestroyShaderProgram(GLuint programId);
+void UReflectShaderProgram(GLuint programId);
+void UStartProgramCompile(ShaderProgram& entry);
+ProgramState UPollShaderProgram(ShaderProgram& entry, bool wait);
+GLuint UReadyProgram(GLuint programId);
+void USetDrawProgram(GLuint programId, GLuint drawProgramId);
+void UResolveShaderPrograms();
+bool UFinishShaderPrograms();
+uint64_t UProgramCacheKey(const char* vtxShaderSource, const char* fragShaderSource);
+std::string UProgramCachePath(uint64_t key);
+bool ULoadProgramBinary(uint64_t key, GLuint& programId);
+void USaveProgramBinary(uint64_t key, GLuint programId);
+void UCreateFrameUniforms();
+void UUpdateFrameUniforms();
+void UDestroyFrameUniforms();
+void UCreateLights();
+int UAddLight(const glm::vec3& position, float radius, const glm::vec3& color, float falloff, float flicker);
+void UScatterLights(int count);
+void UUpdateLights();
+void UAssignLightClusters(const glm::mat4& view, const glm::mat4& projection);
+void UDestroyLights();
+glm::mat4 UProjectionMatrix();
+void UCreateDrawBuffers();
+void UDestroyDrawBuffers();
+void USubmitDraw(GLuint program, const GLDoubleMesh& mesh, GLuint material, const glm::mat4& model, const glm::vec2& uvScale);
+void USubmitDraw(GLuint program, const GLDoubleMesh& mesh, GLuint material, const glm::mat4& model, const glm::mat3& normalMatrix, const glm::vec2& uvScale);
+void USortRenderQueue();
+void UCullRenderQueue();
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4* planes);
+void UCullSpheres(const glm::vec4* planes, size_t count, uint8_t* visible);
+int UAddSceneObject(GLuint program, const GLDoubleMesh* mesh, const LodMesh* lods, GLuint material, const glm::mat4& model, const glm::vec2& uvScale);
+void UTransformBounds(const glm::vec3& localMin, const glm::vec3& localMax, const glm::mat4& model, glm::vec3& worldMin, glm::vec3& worldMax);
+void UBuildSceneBvh();
+int UBuildBvhNode(std::vector<int>& objects, size_t first, size_t last, int parent);
+void UMoveSceneObject(int object, const glm::mat4& model);
+int UAddDeskObject(const char* name, int transform, GLuint program, const GLDoubleMesh* mesh, const LodMesh* lods, GLuint material, const glm::vec2& uvScale, bool castsShadow);
+void UAddDeskObjects();
+void USyncSceneTransforms();
+void UAnimateScene();
+void UPickSceneObject();
+void USceneFrustumQuery(const glm::vec4* planes, std::vector<int>& results);
+void USceneSphereQuery(const glm::vec3& center, float radius, std::vector<int>& results);
+int USceneRayQuery(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float& hitDistance);
+bool URayHitsBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& boxMin, const glm::vec3& boxMax, float maxDistance, float& entry);
+void UCollectBvhLeaves(int node, std::vector<int>& results);
+void UScatterProps(int count);
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId);
+bool UCreateShadowMaps();
+glm::mat4 UShadowViewProjection();
+void UUpdateShadowMaps();
+void URenderShadowCasters(GLuint fbo, bool clear);
+void UDestroyShadowMaps();
+bool UCreateGBuffer(int width, int height);
+void UDeferredLighting();
+void UDestroyGBuffer();
+bool UCreateGBufferTargets(int width, int height);
+void UDestroyGBufferTargets();
+bool UCreateHiZ(int width, int height);
+bool UCreateHiZTargets(int width, int height);
+void UDestroyHiZTargets();
+void UBuildHiZ();
+void UResolveHiZReadback();
+bool USphereOccluded(float x, float y, float z, float radius);
+void UDestroyHiZ();
+void UDrawSceneObjects();
+void UExecuteRenderQueue(bool cameraPass);
+void UDrawBatches(GLuint programOverride);
+GLint UUniform(GLuint programId, UniformId uniform);
+
+/* Per-frame camera, cluster and shadow data, uploaded once per frame; spliced into every program that reads it*/
+const GLchar* frameDataSource = GLSL_SHARED(
+    layout(std140, binding = 0) uniform FrameData {
+        mat4 view;
+        mat4 projection;
+        vec4 viewPosition;
+        vec4 ambientColor;
+        vec4 clusterScale;
+        uvec4 clusterCount;
+        mat4 inverseViewProjection;
+        mat4 shadowViewProjection;
+        vec4 shadowParams;
+    };
+);
+
+
+/* Per-instance data, and the first instance and material layer of each multi-draw command (indexed by DRAW_ID);
+   spliced into every vertex shader that draws from the render queue*/
+const GLchar* instanceDataSource = GLSL_SHARED(
+    struct InstanceData {
+        mat4 model;
+        mat3 normalMatrix;
+        vec4 uvScale;
+    };
+    struct DrawData {
+        uint firstInstance;
+        uint layer;
+    };
+    layout(std430, binding = 0) readonly buffer InstanceBuffer { InstanceData instances[]; };
+    layout(std430, binding = 1) readonly buffer DrawBuffer { DrawData draws[]; };
+    uniform uint drawIdBase; // Index of the multi-draw's first command
+);
+
 
 // Vertex shader source code
 const GLchar* vertexShaderSource = GLSL(440,
@@ -128,19 +861,126 @@ const GLchar* vertexShaderSource = GLSL(440,
     out vec3 vertexNormal;
     out vec3 vertexFragmentPos;
     out vec2 vertexTextureCoordinate;
+    flat out uint vertexLayer;
+
+    // Matches the depth pre-pass exactly
+    invariant gl_Position;
 
-    //Uniform / Global variables for the  transform matrices
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    // FrameData, InstanceData and DrawData come from frameDataSource and instanceDataSource
 
     void main() {
-        gl_Position = projection * view * model * vec4(position, 1.0f);
+        DrawData draw = draws[drawIdBase + DRAW_ID];
+        InstanceData instance = instances[draw.firstInstance + gl_InstanceID];
+
+        gl_Position = projection * view * instance.model * vec4(position, 1.0f);
+
+        vertexFragmentPos = vec3(instance.model * vec4(position, 1.0f));
+
+        // INVERSE_NORMALS is a constant, so only one side survives compilation; the inverse is kept for --vertex-benchmark
+        vertexNormal = (INVERSE_NORMALS ? mat3(transpose(inverse(instance.model))) : instance.normalMatrix) * normal;
+        vertexTextureCoordinate = textureCoordinate * instance.uvScale.xy;
+        vertexLayer = draw.layer;
+    }
+);
+
+
+/* Clustered lighting, shared by the forward fragment shader and the deferred lighting pass*/
+const GLchar* clusteredLightingSource = GLSL_SHARED(
+
+    // Reads FrameData, so frameDataSource must be spliced in ahead of this
+
+    // All lights, and per cluster the range of lightIndices naming the lights that reach it
+    struct PointLight {
+        vec4 positionRadius;
+        vec4 colorFalloff;
+    };
+    layout(std430, binding = 2) readonly buffer LightBuffer { PointLight lights[]; };
+    layout(std430, binding = 3) readonly buffer ClusterBuffer { uvec2 clusters[]; };
+    layout(std430, binding = 4) readonly buffer LightIndexBuffer { uint lightIndices[]; };
+
+    // Shadow map of light 0, the side light
+    layout(binding = 4) uniform sampler2DShadow shadowMap;
+
+    // Fraction of the side light reaching a world-space point: four hardware-filtered taps around it
+    float sideLightShadow(vec3 fragmentPos) {
+        vec4 clip = shadowViewProjection * vec4(fragmentPos, 1.0f);
+        if (shadowParams.x == 0.0f || clip.w <= 0.0f)
+            return 1.0f;
+
+        vec3 coord = clip.xyz / clip.w * 0.5f + 0.5f;
+        vec2 texel = 1.0f / vec2(textureSize(shadowMap, 0));
+        float lit = texture(shadowMap, vec3(coord.xy + vec2(-0.5f, -0.5f) * texel, coord.z))
+                  + texture(shadowMap, vec3(coord.xy + vec2(0.5f, -0.5f) * texel, coord.z))
+                  + texture(shadowMap, vec3(coord.xy + vec2(-0.5f, 0.5f) * texel, coord.z))
+                  + texture(shadowMap, vec3(coord.xy + vec2(0.5f, 0.5f) * texel, coord.z));
+        return lit * 0.25f;
+    }
+
+    // Ambient, diffuse and specular light reaching a world-space point, from the lights of its cluster
+    vec3 clusteredLighting(vec3 fragmentPos, vec3 norm, vec2 fragCoord) {
+        float ambientStrength = 0.5f; // Set ambient or global lighting strength
+        vec3 ambient = ambientStrength * ambientColor.rgb; // Generate ambient light color
+
+        vec3 viewDir = normalize(viewPosition.xyz - fragmentPos); // Calculate view direction
+        float specularIntensity = 0.2f; // Set specular light strength
+        float highlightSize = 12.0f; // Set specular highlight size
 
-        vertexFragmentPos = vec3(model * vec4(position, 1.0f));
+        // Find the cluster from the screen tile and view-space depth
+        float viewDepth = max(-(view * vec4(fragmentPos, 1.0f)).z, 1e-4f);
+        int slice = clamp(int(log(viewDepth) * clusterScale.x + clusterScale.y), 0, int(clusterCount.z) - 1);
+        ivec2 tile = min(ivec2(fragCoord / clusterScale.zw), ivec2(clusterCount.xy) - ivec2(1));
+        uvec2 cluster = clusters[(uint(slice) * clusterCount.y + uint(tile.y)) * clusterCount.x + uint(tile.x)];
+
+        vec3 diffuse = vec3(0.0f);
+        vec3 specular = vec3(0.0f);
+        for (uint i = 0u; i < cluster.y; ++i) {
+            uint lightIndex = lightIndices[cluster.x + i];
+            PointLight light = lights[lightIndex];
+
+            vec3 toLight = light.positionRadius.xyz - fragmentPos;
+            float lightDistance = length(toLight);
+            vec3 lightDirection = toLight / max(lightDistance, 1e-4f); // Direction between light source and fragment
+
+            // Smooth window to zero at the radius, so the light never reaches past the clusters it was assigned to
+            float window = clamp(1.0f - pow(lightDistance / light.positionRadius.w, 4.0f), 0.0f, 1.0f);
+            vec3 radiance = light.colorFalloff.rgb * (window * window / (1.0f + light.colorFalloff.w * lightDistance * lightDistance));
+            if (lightIndex == 0u)
+                radiance *= sideLightShadow(fragmentPos);
+
+            // Diffuse calculation
+            float impact = max(dot(norm, lightDirection), 0.0);
+            diffuse += impact * radiance;
+
+            // Specular calculation
+            vec3 reflectDir = reflect(-lightDirection, norm);
+            float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
+            specular += specularIntensity * specularComponent * radiance;
+        }
+
+        return ambient + diffuse + specular;
+    }
+);
+
+
+/* Octahedral normal packing for the G-buffer: a unit vector in two [0, 1] components*/
+const GLchar* normalPackingSource = GLSL_SHARED(
+
+    vec2 signNotZero(vec2 v) {
+        return vec2(v.x >= 0.0f ? 1.0f : -1.0f, v.y >= 0.0f ? 1.0f : -1.0f);
+    }
 
-        vertexNormal = mat3(transpose(inverse(model))) * normal;
-        vertexTextureCoordinate = textureCoordinate;
+    vec2 packNormal(vec3 n) {
+        n /= abs(n.x) + abs(n.y) + abs(n.z);
+        vec2 folded = n.z >= 0.0f ? n.xy : (1.0f - abs(n.yx)) * signNotZero(n.xy);
+        return folded * 0.5f + 0.5f;
+    }
+
+    vec3 unpackNormal(vec2 encoded) {
+        vec2 folded = encoded * 2.0f - 1.0f;
+        vec3 n = vec3(folded, 1.0f - abs(folded.x) - abs(folded.y));
+        if (n.z < 0.0f)
+            n.xy = (1.0f - abs(n.yx)) * signNotZero(n.xy);
+        return normalize(n);
     }
 );
 
@@ -151,43 +991,84 @@ const GLchar* fragmentShaderSource = GLSL(440,
     in vec3 vertexNormal;
     in vec3 vertexFragmentPos;
     in vec2 vertexTextureCoordinate;
+    flat in uint vertexLayer;
 
     out vec4 fragmentColor;
 
-    // Uniform / Global variables for object color, light color, light position, and camera/view position
+    // Uniform / Global variables for object color and texture
     uniform vec3 objectColor;
-    uniform vec3 lightColor;
-    uniform vec3 lightPos;
-    uniform vec3 viewPosition;
-    uniform sampler2D uTexture;
-    uniform vec2 uvScale;
+    uniform sampler2DArray uTexture;
 
     void main() {
-        float ambientStrength = 0.5f; // Set ambient or global lighting strength
-        vec3 ambient = ambientStrength * lightColor; // Generate ambient light color
+        // Texture holds the color to be used for all three components
+        vec4 textureColor = texture(uTexture, vec3(vertexTextureCoordinate, float(vertexLayer)));
 
-        // Diffuse calculation
-        vec3 norm = normalize(vertexNormal); // Normalize vectors to 1 unit
-        vec3 lightDirection = normalize(lightPos - vertexFragmentPos); // Calculate distance (light direction) between light source and fragments/pixels on cube
-        float impact = max(dot(norm, lightDirection), 0.0);// Calculate diffuse impact by generating dot product of normal and light
-        vec3 diffuse = impact * lightColor; // Generate diffuse light color
+        // Calculate phong result
+        vec3 phong = clusteredLighting(vertexFragmentPos, normalize(vertexNormal), gl_FragCoord.xy) * textureColor.xyz;
 
-        // Specular calculation
-        float specularIntensity = 0.2f; // Set specular light strength
-        float highlightSize = 12.0f; // Set specular highlight size
-        vec3 viewDir = normalize(viewPosition - vertexFragmentPos); // Calculate view direction
-        vec3 reflectDir = reflect(-lightDirection, norm);// Calculate reflection vector
+        fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
+    }
+);
 
-        float specularComponent = pow(max(dot(viewDir, reflectDir), 0.0), highlightSize);
-        vec3 specular = specularIntensity * specularComponent * lightColor;
 
-        // Texture holds the color to be used for all three components
-        vec4 textureColor = texture(uTexture, vertexTextureCoordinate * uvScale);
+/* G-buffer Fragment Shader Source Code: the geometry pass of --deferred*/
+const GLchar* gBufferFragmentShaderSource = GLSL(440,
 
-        // Calculate phong result
-        vec3 phong = (ambient + diffuse + specular) * textureColor.xyz;
+    in vec3 vertexNormal;
+    in vec3 vertexFragmentPos;
+    in vec2 vertexTextureCoordinate;
+    flat in uint vertexLayer;
 
-        fragmentColor = vec4(phong, 1.0); // Send lighting results to GPU
+    // Albedo alpha 0 marks lit surfaces; the single-output light and fallback programs write 1 and stay unlit
+    layout(location = 0) out vec4 gBufferAlbedo;
+    layout(location = 1) out vec2 gBufferNormal;
+
+    uniform sampler2DArray uTexture;
+
+    void main() {
+        gBufferAlbedo = vec4(texture(uTexture, vec3(vertexTextureCoordinate, float(vertexLayer))).rgb, 0.0f);
+        gBufferNormal = packNormal(normalize(vertexNormal));
+    }
+);
+
+
+/* Full-screen triangle Vertex Shader Source Code*/
+const GLchar* fullScreenVertexShaderSource = GLSL(440,
+
+    void main() {
+        vec2 corner = vec2(float((gl_VertexID << 1) & 2), float(gl_VertexID & 2));
+        gl_Position = vec4(corner * 2.0f - 1.0f, 0.0f, 1.0f);
+    }
+);
+
+
+/* Deferred Lighting Fragment Shader Source Code: one lighting evaluation per visible pixel*/
+const GLchar* deferredLightingFragmentShaderSource = GLSL(440,
+
+    layout(binding = 1) uniform sampler2D gBufferAlbedo;
+    layout(binding = 2) uniform sampler2D gBufferNormal;
+    layout(binding = 3) uniform sampler2D gBufferDepth;
+
+    out vec4 fragmentColor;
+
+    void main() {
+        ivec2 pixel = ivec2(gl_FragCoord.xy);
+        float depth = texelFetch(gBufferDepth, pixel, 0).r;
+        if (depth >= 1.0f)
+            discard; // Background keeps the clear color
+
+        vec4 albedo = texelFetch(gBufferAlbedo, pixel, 0);
+        if (albedo.a > 0.5f) {
+            fragmentColor = vec4(albedo.rgb, 1.0f);
+            return;
+        }
+
+        // World position from the pixel and its depth
+        vec2 ndc = gl_FragCoord.xy / vec2(textureSize(gBufferDepth, 0)) * 2.0f - 1.0f;
+        vec4 world = inverseViewProjection * vec4(ndc, depth * 2.0f - 1.0f, 1.0f);
+
+        vec3 normal = unpackNormal(texelFetch(gBufferNormal, pixel, 0).rg);
+        fragmentColor = vec4(clusteredLighting(world.xyz / world.w, normal, gl_FragCoord.xy) * albedo.rgb, 1.0f);
     }
 );
 
@@ -197,12 +1078,11 @@ const GLchar* fragmentShaderSource = GLSL(440,
 const GLchar* lightVertexShaderSource = GLSL(440,
     layout(location = 0) in vec3 position; // VAP position 0 for vertex position data
 
-    // Uniform / Global variables for transform matrix
-    uniform mat4 model;
-    uniform mat4 view;
-    uniform mat4 projection;
+    // Matches the depth pre-pass exactly
+    invariant gl_Position;
 
     void main() {
+        mat4 model = instances[draws[drawIdBase + DRAW_ID].firstInstance + gl_InstanceID].model;
         gl_Position = projection * view * model * vec4(position, 1.0f); // Trasnform vertices into clip coordinates
     }
 );
@@ -220,99 +1100,372 @@ const GLchar* lightFragmentShaderSource = GLSL(440,
 );
 
 
+/* Hi-Z Compute Shader Source Code*/
+const GLchar* hiZComputeShaderSource = GLSL(440,
 
-// flip y axis
-void flipImageVertically(unsigned char* image, int width, int height, int channels)
-{
-    for (int j = 0; j < height / 2; ++j)
-    {
-        int index1 = j * width * channels;
-        int index2 = (height - 1 - j) * width * channels;
+    layout(local_size_x = 8, local_size_y = 8) in;
 
-        for (int i = width * channels; i > 0; --i)
-        {
-            unsigned char tmp = image[index1];
-            image[index1] = image[index2];
-            image[index2] = tmp;
-            ++index1;
-            ++index2;
-        }
+    // The depth buffer copy for level 0, otherwise the pyramid itself one level up
+    uniform sampler2D sourceDepth;
+    uniform int sourceLevel;
+    layout(r32f, binding = 0) writeonly uniform image2D destination;
+
+    void main() {
+        ivec2 texel = ivec2(gl_GlobalInvocationID.xy);
+        ivec2 size = imageSize(destination);
+        if (texel.x >= size.x || texel.y >= size.y)
+            return;
+
+        // Farthest depth of the 2x2 footprint; the last row/column also takes the leftover texel of odd sizes
+        ivec2 sourceSize = textureSize(sourceDepth, sourceLevel);
+        ivec2 first = texel * 2;
+        ivec2 last = min(first + ivec2(1) + ivec2(equal(texel, size - ivec2(1))) * (sourceSize - size * 2), sourceSize - ivec2(1));
+
+        float depth = 0.0f;
+        for (int y = first.y; y <= last.y; ++y)
+            for (int x = first.x; x <= last.x; ++x)
+                depth = max(depth, texelFetch(sourceDepth, ivec2(x, y), sourceLevel).r);
+
+        imageStore(destination, texel, vec4(depth));
     }
-}
+);
 
 
-int main(int argc, char* argv[])
-{
-    if (!UInitialize(argc, argv, &gWindow))
-        return EXIT_FAILURE;
+/* Shadow Vertex Shader Source Code: depth only, from the side light*/
+const GLchar* shadowVertexShaderSource = GLSL(440,
+    layout(location = 0) in vec3 position;
 
-    // Create the meshes
-    createPlaneMesh(planeMesh);
-    createWandboxMesh(wandBoxMesh);
-    createPagesMesh(pagesMesh);
-    createBookCoverMesh(bookCoverMesh);
-    createWandMesh(cylinderMesh);
-    createMugMesh(mugMesh);
-    UCreateLightMesh(lMesh);
+    void main() {
+        mat4 model = instances[draws[drawIdBase + DRAW_ID].firstInstance + gl_InstanceID].model;
+        gl_Position = shadowViewProjection * model * vec4(position, 1.0f);
+    }
+);
 
-    // Create the shader programs
-    if (!UCreateShaderProgram(vertexShaderSource, fragmentShaderSource, gProgramId))
-        return EXIT_FAILURE;
 
+/* Depth-only Fragment Shader Source Code, for the shadow map and the depth pre-pass*/
+const GLchar* depthOnlyFragmentShaderSource = GLSL(440,
 
-    if (!UCreateShaderProgram(lightVertexShaderSource, lightFragmentShaderSource, gLightProgramId))
-        return EXIT_FAILURE;
+    void main() {
+    }
+);
 
 
-    // Load textures
-    const char* filenameBookCover = ".\\textures\\DarkBlue.jpg";
-    const char* filenamePages = ".\\textures\\pagesTexture.jpg";
-    const char* filenameGreenLeather = ".\\textures\\greenLeather.png";
-    const char* filenameWoodFloor = ".\\textures\\lightWoodFlooring.jpg";
-    const char* filenameDarkWood = ".\\textures\\DarkWood.jpg";
-    const char* filenameCeramic = ".\\textures\\ceramicTexture.jpg";
+/* Depth Pre-pass Vertex Shader Source Code: position only, transformed exactly like the main program*/
+const GLchar* depthVertexShaderSource = GLSL(440,
+    layout(location = 0) in vec3 position;
 
-    // Check if textures loaded
-    if (!UCreateTexture(filenameBookCover, bookCoverTexture)) {
-        cout << "Failed to load texture: " << filenameBookCover << endl;
-        return EXIT_FAILURE;
-    }
+    // Bit-identical depth to the shading pass, which tests against it with GL_EQUAL
+    invariant gl_Position;
 
-    if (!UCreateTexture(filenamePages, bookPagesTexture)) {
-        cout << "Failed to load texture: " << filenamePages << endl;
-        return EXIT_FAILURE;
+    void main() {
+        InstanceData instance = instances[draws[drawIdBase + DRAW_ID].firstInstance + gl_InstanceID];
+        gl_Position = projection * view * instance.model * vec4(position, 1.0f);
     }
+);
 
-    if (!UCreateTexture(filenameGreenLeather, greenLeatherTexture)) {
-        cout << "Failed to load texture: " << filenameGreenLeather << endl;
-        return EXIT_FAILURE;
-    }
 
-    if (!UCreateTexture(filenameWoodFloor, woodFloorTexture)) {
-        cout << "Failed to load texture: " << filenameWoodFloor << endl;
-        return EXIT_FAILURE;
+/* Overdraw Fragment Shader Source Code: with additive blending, brightness counts the fragments shaded per pixel*/
+const GLchar* overdrawFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor;
+
+    void main() {
+        fragmentColor = vec4(0.125f, 0.125f, 0.125f, 1.0f); // White at 8 layers
+    }
+);
+
+
+/* Fallback Fragment Shader Source Code*/
+const GLchar* fallbackFragmentShaderSource = GLSL(440,
+
+    out vec4 fragmentColor;
+
+    void main() {
+        fragmentColor = vec4(0.6f, 0.6f, 0.6f, 1.0f); // Flat grey until the real program is linked
+    }
+);
+
+
+
+// Swap two rows of pixels, 32 or 16 bytes at a time
+void USwapRows(unsigned char* first, unsigned char* second, size_t bytes)
+{
+    size_t i = 0;
+#if defined(USIMD_AVX2)
+    for (; i + 32 <= bytes; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(first + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(second + i));
+        _mm256_storeu_si256((__m256i*)(first + i), b);
+        _mm256_storeu_si256((__m256i*)(second + i), a);
+    }
+#endif
+#if defined(USIMD_SSE2)
+    for (; i + 16 <= bytes; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(first + i));
+        __m128i b = _mm_loadu_si128((const __m128i*)(second + i));
+        _mm_storeu_si128((__m128i*)(first + i), b);
+        _mm_storeu_si128((__m128i*)(second + i), a);
+    }
+#endif
+    for (; i < bytes; ++i)
+        std::swap(first[i], second[i]);
+}
+
+// flip y axis
+void flipImageVertically(unsigned char* image, int width, int height, int channels)
+{
+    const size_t rowBytes = (size_t)width * channels;
+    for (int j = 0; j < height / 2; ++j)
+        USwapRows(image + j * rowBytes, image + (height - 1 - j) * rowBytes, rowBytes);
+}
+
+// Byte-at-a-time flip, kept as the baseline for --image-benchmark
+void UFlipImageScalar(unsigned char* image, int width, int height, int channels)
+{
+    for (int j = 0; j < height / 2; ++j)
+    {
+        int index1 = j * width * channels;
+        int index2 = (height - 1 - j) * width * channels;
+
+        for (int i = width * channels; i > 0; --i)
+        {
+            unsigned char tmp = image[index1];
+            image[index1] = image[index2];
+            image[index2] = tmp;
+            ++index1;
+            ++index2;
+        }
+    }
+}
+
+// Expand RGB8 pixels to opaque RGBA8
+void UExpandRgbToRgbaScalar(const unsigned char* rgb, unsigned char* rgba, size_t pixelCount)
+{
+    for (size_t i = 0; i < pixelCount; ++i)
+    {
+        rgba[i * 4 + 0] = rgb[i * 3 + 0];
+        rgba[i * 4 + 1] = rgb[i * 3 + 1];
+        rgba[i * 4 + 2] = rgb[i * 3 + 2];
+        rgba[i * 4 + 3] = 255;
+    }
+}
+
+// Expand RGB8 pixels to opaque RGBA8 with byte shuffles, 8 (AVX2) or 4 (SSSE3) pixels per step
+void UExpandRgbToRgba(const unsigned char* rgb, unsigned char* rgba, size_t pixelCount)
+{
+    size_t i = 0;
+#if defined(USIMD_SSSE3)
+    // Each 16-byte load covers 4 pixels plus 4 bytes of the next, so the loops stop short of the end
+    const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+#if defined(USIMD_AVX2)
+    const __m256i shuffle8 = _mm256_broadcastsi128_si256(shuffle);
+    const __m256i alpha8 = _mm256_broadcastsi128_si256(alpha);
+    for (; i + 10 <= pixelCount; i += 8)
+    {
+        __m256i pixels = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(rgb + i * 3))),
+            _mm_loadu_si128((const __m128i*)(rgb + i * 3 + 12)), 1);
+        _mm256_storeu_si256((__m256i*)(rgba + i * 4), _mm256_or_si256(_mm256_shuffle_epi8(pixels, shuffle8), alpha8));
+    }
+#endif
+    for (; i + 6 <= pixelCount; i += 4)
+    {
+        __m128i pixels = _mm_loadu_si128((const __m128i*)(rgb + i * 3));
+        _mm_storeu_si128((__m128i*)(rgba + i * 4), _mm_or_si128(_mm_shuffle_epi8(pixels, shuffle), alpha));
+    }
+#endif
+    UExpandRgbToRgbaScalar(rgb + i * 3, rgba + i * 4, pixelCount - i);
+}
+
+
+int main(int argc, char* argv[])
+{
+    UParseCommandLine(argc, argv);
+
+    // The image kernel benchmark needs no GL context
+    if (gImageBenchmark)
+        return URunImageBenchmark() ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    if (!UInitialize(argc, argv, &gWindow))
+        return EXIT_FAILURE;
+
+    // gl_DrawIDARB lets one multi-draw index per-draw data; without it every command is issued separately
+    gHasDrawParameters = GLEW_ARB_shader_draw_parameters;
+    gHasS3tc = GLEW_EXT_texture_compression_s3tc;
+
+    // Let the driver compile on as many threads as it likes
+    gHasParallelShaderCompile = GLEW_KHR_parallel_shader_compile;
+    if (gHasParallelShaderCompile)
+        glMaxShaderCompilerThreadsKHR(0xFFFFFFFF);
+
+    GLint binaryFormatCount = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &binaryFormatCount);
+    gHasProgramBinary = binaryFormatCount > 0;
+
+    // Every mesh is sub-allocated from this arena
+    UCreateMeshArena(16384, 65536);
+    UCreateDrawBuffers();
+
+    // Create the meshes
+    createPlaneMesh(planeMesh);
+    createWandboxMesh(wandBoxMesh);
+    createPagesMesh(pagesMesh);
+    createBookCoverMesh(bookCoverMesh);
+    createWandMesh(cylinderLods);
+    createMugMesh(mugLods);
+    UCreateLightMesh(lMesh);
+
+    // Create the shader programs. The fallback is finished right away; the others keep compiling in the
+    // driver while the textures load, and draws use the fallback until they link
+    std::string lightVertexSource = UAddDrawParameters(UAddInstanceInterface(lightVertexShaderSource));
+    if (!UCreateShaderProgram(lightVertexSource.c_str(), fallbackFragmentShaderSource, gFallbackProgramId)
+        || !UFinishShaderPrograms())
+        return EXIT_FAILURE;
+
+    // Forward shading lights every fragment as it is drawn; --deferred writes the G-buffer instead and lights
+    // each visible pixel once in a full-screen pass
+    std::string fragmentSource = gDeferred
+        ? UAddDefines(gBufferFragmentShaderSource, normalPackingSource)
+        : UAddDefines(UAddDefines(fragmentShaderSource, clusteredLightingSource), frameDataSource);
+
+    std::string vertexSource = UAddDefines(UAddDrawParameters(UAddInstanceInterface(vertexShaderSource)), "#define INVERSE_NORMALS false\n");
+    if (!UCreateShaderProgram(vertexSource.c_str(), fragmentSource.c_str(), gProgramId))
+        return EXIT_FAILURE;
+
+    if (gDeferred)
+    {
+        std::string lightingSource = UAddDefines(UAddDefines(UAddDefines(deferredLightingFragmentShaderSource, normalPackingSource), clusteredLightingSource), frameDataSource);
+        if (!UCreateShaderProgram(fullScreenVertexShaderSource, lightingSource.c_str(), gDeferredLightingProgramId))
+            return EXIT_FAILURE;
+    }
+
+    // The old per-vertex inverse(), only for comparison by the vertex benchmark
+    if (gVertexBenchmark)
+    {
+        std::string inverseSource = UAddDefines(UAddDrawParameters(UAddInstanceInterface(vertexShaderSource)), "#define INVERSE_NORMALS true\n");
+        if (!UCreateShaderProgram(inverseSource.c_str(), fragmentSource.c_str(), gInverseNormalProgramId))
+            return EXIT_FAILURE;
+    }
+
+    if (!UCreateShaderProgram(lightVertexSource.c_str(), lightFragmentShaderSource, gLightProgramId))
+        return EXIT_FAILURE;
+
+    std::string depthVertexSource = UAddDrawParameters(UAddInstanceInterface(depthVertexShaderSource));
+    if (gDepthPrepass && !UCreateShaderProgram(depthVertexSource.c_str(), depthOnlyFragmentShaderSource, gDepthProgramId))
+        return EXIT_FAILURE;
+
+    if (gOverdrawView)
+    {
+        if (!UCreateShaderProgram(depthVertexSource.c_str(), overdrawFragmentShaderSource, gOverdrawProgramId))
+            return EXIT_FAILURE;
+        glGenQueries(1, &gOverdrawQuery);
+    }
+
+    if (gShadows)
+    {
+        std::string shadowVertexSource = UAddDrawParameters(UAddInstanceInterface(shadowVertexShaderSource));
+        if (!UCreateShaderProgram(shadowVertexSource.c_str(), depthOnlyFragmentShaderSource, gShadowProgramId))
+            return EXIT_FAILURE;
+    }
+
+
+    // Load textures
+    const char* filenameBookCover = "./textures/DarkBlue.jpg";
+    const char* filenamePages = "./textures/pagesTexture.jpg";
+    const char* filenameGreenLeather = "./textures/greenLeather.png";
+    const char* filenameWoodFloor = "./textures/lightWoodFlooring.jpg";
+    const char* filenameDarkWood = "./textures/DarkWood.jpg";
+    const char* filenameCeramic = "./textures/ceramicTexture.jpg";
+
+    // Check if textures loaded
+    if (!ULoadMaterial(filenameBookCover, bookCoverMaterial)) {
+        cout << "Failed to load texture: " << filenameBookCover << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!ULoadMaterial(filenamePages, bookPagesMaterial)) {
+        cout << "Failed to load texture: " << filenamePages << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!ULoadMaterial(filenameGreenLeather, greenLeatherMaterial)) {
+        cout << "Failed to load texture: " << filenameGreenLeather << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (!ULoadMaterial(filenameWoodFloor, woodFloorMaterial)) {
+        cout << "Failed to load texture: " << filenameWoodFloor << endl;
+        return EXIT_FAILURE;
     }
 
-    if (!UCreateTexture(filenameDarkWood, wandWoodTexture)) {
+    if (!ULoadMaterial(filenameDarkWood, wandWoodMaterial)) {
         cout << "Failed to load texture: " << filenameDarkWood << endl;
         return EXIT_FAILURE;
 
     }
 
-    if (!UCreateTexture(filenameCeramic, mugTexture)) {
+    if (!ULoadMaterial(filenameCeramic, mugMaterial)) {
         cout << "Failed to load texture: " << filenameCeramic << endl;
         return EXIT_FAILURE;
     }
 
-    // Tell OpenGL for each sampler to which texture unit it belongs to. 
-    glUseProgram(gProgramId);
+    // Decode the textures in parallel and pack them into texture arrays, one per image size
+    if (!UBuildTextureArrays())
+        return EXIT_FAILURE;
+
+    // Placement of the desk objects
+    UCreateSceneTransforms();
+
+    // Side light plus any --lights candles, and the cluster buffers they are assigned through
+    UCreateLights();
+
+    // Desk objects and lamp cubes go into the scene BVH, with any optional extra props
+    UAddDeskObjects();
+    gAnimationStart = std::chrono::steady_clock::now();
+    gWandBaseAngle = gTransforms.rotationAngle[gWandTransform];
+    if (gPropCount > 0)
+        UScatterProps(gPropCount);
+
+    // Camera and light uniform buffer shared by both programs
+    UCreateFrameUniforms();
+
+    if (gShadows && !UCreateShadowMaps())
+        return EXIT_FAILURE;
+
+    if (gDeferred && !UCreateGBuffer(gFramebufferWidth, gFramebufferHeight))
+        return EXIT_FAILURE;
+
+    if (gOcclusionCulling && !UCreateHiZ(gFramebufferWidth, gFramebufferHeight))
+        return EXIT_FAILURE;
+
+    // Per-stage timing is only collected when a CSV file was requested
+    if (gTimingCsvPath && !UInitTiming(gTimingCsvPath))
+        return EXIT_FAILURE;
+
+    // Headless runs render a fixed number of frames offscreen and report their timing, with the real programs
+    if (gHeadless)
+    {
+        if (!UFinishShaderPrograms())
+            return EXIT_FAILURE;
+        if (gVertexBenchmark)
+            URunVertexBenchmark();
+        else
+            URunFrameBenchmark(gBenchmarkFrames);
+    }
 
-    // We set the texture as texture unit 0
-    glUniform1i(glGetUniformLocation(gProgramId, "uTexture"), 0);
+    // Swap interval, frame slots and GPU clock for the window loop
+    if (!gHeadless)
+        UInitFramePacing();
 
     // Render loop
-    while (!glfwWindowShouldClose(gWindow))
+    while (!gHeadless && !glfwWindowShouldClose(gWindow))
     {
+        // Wait for a free frame slot and the fixed-rate deadline, then poll, so input is sampled as late as possible
+        UBeginPacedFrame();
+        glfwPollEvents();
+
         // Frame timing
         float currentFrame = glfwGetTime();
         gDeltaTime = currentFrame - gLastFrame;
@@ -324,29 +1477,58 @@ int main(int argc, char* argv[])
 
         // Render current frame
         URender();
-        glfwPollEvents();
+        UPresentFrame();
+        UEndPacedFrame();
     }
 
+    if (!gHeadless)
+        UDestroyFramePacing();
+
     // Release mesh data
     UDestroyMesh(planeMesh);
     UDestroyMesh(wandBoxMesh);
     UDestroyMesh(pagesMesh);
     UDestroyMesh(bookCoverMesh);
-    UDestroyMesh(cylinderMesh);
-    UDestroyMesh(mugMesh);
+    UDestroyLodMesh(cylinderLods);
+    UDestroyLodMesh(mugLods);
     UDestroyMesh(lMesh);
+    UDestroyMeshArena();
+    UDestroyDrawBuffers();
 
     // Release texture
-    UDestroyTexture(bookCoverTexture);
-    UDestroyTexture(bookPagesTexture);
-    UDestroyTexture(greenLeatherTexture);
-    UDestroyTexture(woodFloorTexture);
-    UDestroyTexture(wandWoodTexture);
-    UDestroyTexture(mugTexture);
+    UDestroyTextureArrays();
 
     // Release shader program
     UDestroyShaderProgram(gProgramId);
     UDestroyShaderProgram(gLightProgramId);
+    UDestroyShaderProgram(gFallbackProgramId);
+    UDestroyHiZ();
+    if (gDepthPrepass)
+        UDestroyShaderProgram(gDepthProgramId);
+    if (gOverdrawView)
+    {
+        UDestroyShaderProgram(gOverdrawProgramId);
+        glDeleteQueries(1, &gOverdrawQuery);
+    }
+    if (gShadows)
+    {
+        UDestroyShaderProgram(gShadowProgramId);
+        UDestroyShadowMaps();
+    }
+    if (gDeferred)
+    {
+        UDestroyShaderProgram(gDeferredLightingProgramId);
+        UDestroyGBuffer();
+    }
+    if (gVertexBenchmark)
+        UDestroyShaderProgram(gInverseNormalProgramId);
+    UDestroyFrameUniforms();
+    UDestroyLights();
+
+    UDestroyTiming();
+
+    if (gHeadless)
+        UDestroyHeadless();
 
     exit(EXIT_SUCCESS); // Terminates the program successfully
 }
@@ -355,6 +1537,10 @@ int main(int argc, char* argv[])
 // Initialize GLFW, GLEW, and create a window
 bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 {
+    // No window in headless mode, render into an offscreen framebuffer instead
+    if (gHeadless)
+        return UCreateHeadlessContext();
+
     // GLFW: initialize and configure
     // ------------------------------
     glfwInit();
@@ -362,6 +1548,10 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
     glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
     glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
+    // Hi-Z copies the window's depth with a blit, which needs the same format as its depth texture
+    glfwWindowHint(GLFW_DEPTH_BITS, 24);
+    glfwWindowHint(GLFW_STENCIL_BITS, 8);
+
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
@@ -374,6 +1564,7 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
         return false;
     }
     glfwMakeContextCurrent(*window);
+    glfwGetFramebufferSize(*window, &gFramebufferWidth, &gFramebufferHeight); // Differs from the window size on high-DPI displays
     glfwSetFramebufferSizeCallback(*window, UResizeWindow);
     glfwSetCursorPosCallback(*window, UMousePositionCallback);
     glfwSetScrollCallback(*window, UMouseScrollCallback);
@@ -396,93 +1587,767 @@ bool UInitialize(int argc, char* argv[], GLFWwindow** window)
 }
 
 
-// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
-void UProcessInput(GLFWwindow* window)
+// Reads the command-line options (see README.md)
+void UParseCommandLine(int argc, char* argv[])
 {
-    static const float cameraSpeed = 2.5f;
-
-    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
-        glfwSetWindowShouldClose(window, true);
-
-    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
-    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
-        gCamera.ProcessKeyboard(UP, gDeltaTime);
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "--headless") == 0)
+            gHeadless = true;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            gBenchmarkFrames = max(1, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc)
+        {
+            const char* mode = argv[++i];
+            if (strcmp(mode, "uncapped") == 0)
+                gPacingMode = PACING_UNCAPPED;
+            else if (strcmp(mode, "fixed") == 0)
+                gPacingMode = PACING_FIXED;
+            else if (strcmp(mode, "vsync") == 0)
+                gPacingMode = PACING_VSYNC;
+            else
+                cout << "Ignoring unknown pacing mode: " << mode << " (expected vsync, uncapped or fixed)" << endl;
+        }
+        else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc)
+        {
+            gPacingMode = PACING_FIXED;
+            gTargetFps = max(1.0, atof(argv[++i]));
+        }
+        else if (strcmp(argv[i], "--frames-in-flight") == 0 && i + 1 < argc)
+            gFramesInFlight = min(MAX_FRAMES_IN_FLIGHT, max(1, atoi(argv[++i])));
+        else if (strcmp(argv[i], "--timing-csv") == 0 && i + 1 < argc)
+            gTimingCsvPath = argv[++i];
+        else if (strcmp(argv[i], "--props") == 0 && i + 1 < argc)
+            gPropCount = max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--lights") == 0 && i + 1 < argc)
+            gLightCount = max(0, atoi(argv[++i]));
+        else if (strcmp(argv[i], "--no-shadows") == 0)
+            gShadows = false;
+        else if (strcmp(argv[i], "--animate") == 0)
+            gAnimate = true;
+        else if (strcmp(argv[i], "--depth-prepass") == 0)
+            gDepthPrepass = true;
+        else if (strcmp(argv[i], "--overdraw") == 0)
+            gOverdrawView = true;
+        else if (strcmp(argv[i], "--deferred") == 0)
+            gDeferred = true;
+        else if (strcmp(argv[i], "--no-cull") == 0)
+            gFrustumCulling = false;
+        else if (strcmp(argv[i], "--no-occlusion") == 0)
+            gOcclusionCulling = false;
+        else if (strcmp(argv[i], "--image-benchmark") == 0)
+            gImageBenchmark = true;
+        else if (strcmp(argv[i], "--vertex-benchmark") == 0)
+            gHeadless = gVertexBenchmark = true;
+        else
+            cout << "Ignoring unknown argument: " << argv[i] << endl;
+    }
 }
 
-void UResizeWindow(GLFWwindow* window, int width, int height)
-{
-    glViewport(0, 0, width, height);
-}
 
-void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+// Create a GL 4.4 core context without a display and point rendering at an offscreen target
+bool UCreateHeadlessContext()
 {
-    if (gFirstMouse)
+#ifdef UHEADLESS_EGL
+    // Prefer Mesa's surfaceless platform so no X server or GPU is needed (llvmpipe)
+    PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay =
+        (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (getPlatformDisplay)
+        gEglDisplay = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+    if (gEglDisplay == EGL_NO_DISPLAY)
+        gEglDisplay = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+    EGLint major, minor;
+    if (gEglDisplay == EGL_NO_DISPLAY || !eglInitialize(gEglDisplay, &major, &minor))
     {
-        gLastX = xpos;
-        gLastY = ypos;
-        gFirstMouse = false;
+        std::cout << "Failed to initialize EGL display" << std::endl;
+        return false;
     }
 
-    float xoffset = xpos - gLastX;
-    float yoffset = gLastY - ypos; 
+    if (!eglBindAPI(EGL_OPENGL_API))
+    {
+        std::cout << "EGL implementation does not support desktop OpenGL" << std::endl;
+        return false;
+    }
 
-    gLastX = xpos;
-    gLastY = ypos;
+    // Surfaceless contexts never draw to an EGL surface, so any GL-capable config (or none) will do
+    const EGLint configAttribs[] = { EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT, EGL_NONE };
+    EGLConfig config = EGL_NO_CONFIG_KHR;
+    EGLint numConfigs = 0;
+    eglChooseConfig(gEglDisplay, configAttribs, &config, 1, &numConfigs);
+    if (numConfigs == 0)
+        config = EGL_NO_CONFIG_KHR;
+
+    const EGLint contextAttribs[] = {
+        EGL_CONTEXT_MAJOR_VERSION, 4,
+        EGL_CONTEXT_MINOR_VERSION, 4,
+        EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT,
+        EGL_NONE
+    };
+    gEglContext = eglCreateContext(gEglDisplay, config, EGL_NO_CONTEXT, contextAttribs);
+    if (gEglContext == EGL_NO_CONTEXT || !eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, gEglContext))
+    {
+        std::cout << "Failed to create surfaceless EGL context" << std::endl;
+        return false;
+    }
+#else
+    // Other platforms fall back to an invisible GLFW window that is never presented
+    glfwInit();
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 4);
+    glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+    glfwWindowHint(GLFW_VISIBLE, GL_FALSE);
 
-    gCamera.ProcessMouseMovement(xoffset, yoffset);
-}
+    gWindow = glfwCreateWindow(WINDOW_WIDTH, WINDOW_HEIGHT, WINDOW_TITLE, NULL, NULL);
+    if (gWindow == NULL)
+    {
+        std::cout << "Failed to create hidden GLFW window" << std::endl;
+        glfwTerminate();
+        return false;
+    }
+    glfwMakeContextCurrent(gWindow);
+#endif
 
+    glewExperimental = GL_TRUE;
+    GLenum GlewInitResult = glewInit();
 
-void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
-{
-    gCamera.ProcessMouseScroll(yoffset);
+    // GLEW built for GLX reports a missing X display under EGL even though the entry points loaded
+    if (GLEW_OK != GlewInitResult && GLEW_ERROR_NO_GLX_DISPLAY != GlewInitResult)
+    {
+        std::cerr << glewGetErrorString(GlewInitResult) << std::endl;
+        return false;
+    }
+
+    cout << "INFO: OpenGL Version: " << glGetString(GL_VERSION) << endl;
+    cout << "INFO: OpenGL Renderer: " << glGetString(GL_RENDERER) << endl;
+
+    return UCreateOffscreenTarget(WINDOW_WIDTH, WINDOW_HEIGHT);
 }
 
 
-void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+// Color + depth framebuffer the scene renders into when headless
+bool UCreateOffscreenTarget(int width, int height)
 {
-    switch (button)
-    {
-    case GLFW_MOUSE_BUTTON_LEFT:
-    {
-        if (action == GLFW_PRESS)
-            cout << "Left mouse button pressed" << endl;
-        else
-            cout << "Left mouse button released" << endl;
-    }
-    break;
+    glGenRenderbuffers(1, &gOffscreenColor);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenColor);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
 
-    case GLFW_MOUSE_BUTTON_MIDDLE:
-    {
-        if (action == GLFW_PRESS)
-            cout << "Middle mouse button pressed" << endl;
-        else
-            cout << "Middle mouse button released" << endl;
-    }
-    break;
+    glGenRenderbuffers(1, &gOffscreenDepth);
+    glBindRenderbuffer(GL_RENDERBUFFER, gOffscreenDepth);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH24_STENCIL8, width, height);
 
-    case GLFW_MOUSE_BUTTON_RIGHT:
+    glGenFramebuffers(1, &gOffscreenFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, gOffscreenColor);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_RENDERBUFFER, gOffscreenDepth);
+
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
     {
-        if (action == GLFW_PRESS)
-            cout << "Right mouse button pressed" << endl;
-        else
-            cout << "Right mouse button released" << endl;
+        std::cout << "ERROR::FRAMEBUFFER::OFFSCREEN_TARGET_INCOMPLETE" << std::endl;
+        return false;
     }
-    break;
 
-    default:
-        cout << "Unhandled mouse button event" << endl;
-        break;
-    }
+    glViewport(0, 0, width, height);
+
+    return true;
+}
+
+
+// Release the offscreen target and the headless context
+void UDestroyHeadless()
+{
+    glDeleteFramebuffers(1, &gOffscreenFbo);
+    glDeleteRenderbuffers(1, &gOffscreenColor);
+    glDeleteRenderbuffers(1, &gOffscreenDepth);
+
+#ifdef UHEADLESS_EGL
+    eglMakeCurrent(gEglDisplay, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(gEglDisplay, gEglContext);
+    eglTerminate(gEglDisplay);
+#else
+    glfwDestroyWindow(gWindow);
+    glfwTerminate();
+#endif
+}
+
+
+// Render a fixed number of frames and report min/median/p99 frame time
+void URunFrameBenchmark(int frameCount)
+{
+    std::vector<double> frameTimes;
+    frameTimes.reserve(frameCount);
+    size_t frustumCulled = 0, occluded = 0, drawn = 0, transformsRebuilt = 0;
+    const size_t staticShadowRenders = gStaticShadowRenders;
+    GLuint64 shadedFragments = 0;
+
+    for (int frame = 0; frame < BENCHMARK_WARMUP_FRAMES + frameCount; ++frame)
+    {
+        auto start = std::chrono::steady_clock::now();
+
+        URender();
+        // Wait for the GPU so the sample covers the whole frame, not just command submission
+        glFinish();
+
+        auto end = std::chrono::steady_clock::now();
+        double frameMs = std::chrono::duration<double, std::milli>(end - start).count();
+
+        gDeltaTime = (float)(frameMs / 1000.0);
+        if (frame >= BENCHMARK_WARMUP_FRAMES)
+        {
+            frameTimes.push_back(frameMs);
+            frustumCulled += gCulledCount;
+            occluded += gOccludedCount;
+            drawn += gDrawnCount;
+            transformsRebuilt += gTransformsRebuilt;
+
+            // The frame has finished, so the query result is ready without a stall
+            if (gOverdrawQueryIssued)
+            {
+                GLuint64 samples = 0;
+                glGetQueryObjectui64v(gOverdrawQuery, GL_QUERY_RESULT, &samples);
+                shadedFragments += samples;
+            }
+        }
+    }
+
+    std::sort(frameTimes.begin(), frameTimes.end());
+    size_t p99Index = (size_t)(0.99 * (frameTimes.size() - 1) + 0.5);
+
+    cout << "BENCHMARK: frames=" << frameTimes.size()
+         << " min_ms=" << frameTimes.front()
+         << " median_ms=" << frameTimes[frameTimes.size() / 2]
+         << " p99_ms=" << frameTimes[p99Index] << endl;
+
+    // Average packets per frame at each culling step
+    cout << "CULLING: frustum_culled=" << (double)frustumCulled / frameTimes.size()
+         << " occluded=" << (double)occluded / frameTimes.size()
+         << " drawn=" << (double)drawn / frameTimes.size() << endl;
+
+    // Zero for a static scene once the first frame has built the world matrices
+    cout << "TRANSFORMS: rebuilt_per_frame=" << (double)transformsRebuilt / frameTimes.size() << endl;
+
+    // Fragments that ran the shading program, per pixel of the frame: 1.0 would be no overdraw at full coverage
+    if (gOverdrawView)
+        cout << "OVERDRAW: depth_prepass=" << (gDepthPrepass ? 1 : 0)
+             << " shaded_fragments_per_pixel=" << (double)shadedFragments / ((double)WINDOW_WIDTH * WINDOW_HEIGHT * frameTimes.size()) << endl;
+
+    // Including warm-up frames; 1 for a static scene
+    if (gShadows)
+        cout << "SHADOWS: static_renders=" << gStaticShadowRenders - staticShadowRenders
+             << " moving_casters=" << gDynamicSceneObjects.size() << endl;
+}
+
+
+// Draws a grid of mug and wand instances with the rasterizer discarded, so the GL_TIME_ELAPSED query covers
+// the vertex stage only, once with the normal matrix from the instance buffer and once with inverse() per vertex
+void URunVertexBenchmark()
+{
+    struct { const char* name; const GLDoubleMesh* mesh; } meshes[] = {
+        { "mug", &mugLods.levels[0] },
+        { "wand", &cylinderLods.levels[0] }
+    };
+    struct { const char* name; GLuint program; } variants[] = {
+        { "inverse_per_vertex", gInverseNormalProgramId },
+        { "cpu_normal_matrix", gProgramId }
+    };
+
+    GLuint query;
+    glGenQueries(1, &query);
+    glEnable(GL_RASTERIZER_DISCARD);
+
+    for (const auto& mesh : meshes)
+    {
+        for (const auto& variant : variants)
+        {
+            std::vector<double> samples;
+            for (int frame = 0; frame < BENCHMARK_WARMUP_FRAMES + gBenchmarkFrames; ++frame)
+            {
+                for (int i = 0; i < VERTEX_BENCHMARK_INSTANCES; ++i)
+                {
+                    glm::mat4 model = glm::translate(glm::vec3((float)(i % 16) - 8.0f, 0.0f, (float)(i / 16) - 8.0f))
+                                    * glm::rotate((float)i, glm::vec3(0.0f, 1.0f, 0.0f))
+                                    * glm::scale(glm::vec3(0.2f, 0.3f, 0.2f));
+                    USubmitDraw(variant.program, *mesh.mesh, mugMaterial, model, glm::vec2(1.0f, 1.0f));
+                }
+
+                // Not a camera pass, so no culling: every instance must reach the vertex stage
+                glBeginQuery(GL_TIME_ELAPSED, query);
+                UExecuteRenderQueue(false);
+                glEndQuery(GL_TIME_ELAPSED);
+
+                GLuint64 elapsedNs = 0;
+                glGetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsedNs);
+                if (frame >= BENCHMARK_WARMUP_FRAMES)
+                    samples.push_back(elapsedNs / 1.0e6);
+            }
+
+            std::sort(samples.begin(), samples.end());
+            cout << "VERTEX_BENCHMARK: mesh=" << mesh.name << " vertices=" << mesh.mesh->nVertices
+                 << " instances=" << VERTEX_BENCHMARK_INSTANCES << " variant=" << variant.name
+                 << " median_ms=" << samples[samples.size() / 2] << endl;
+        }
+    }
+
+    glDisable(GL_RASTERIZER_DISCARD);
+    glDeleteQueries(1, &query);
+}
+
+
+// Best of IMAGE_BENCHMARK_RUNS timings, in milliseconds
+template <typename Kernel>
+double UTimeImageKernel(Kernel kernel)
+{
+    double best = 1e30;
+    for (int run = 0; run < IMAGE_BENCHMARK_RUNS; ++run)
+    {
+        auto start = std::chrono::steady_clock::now();
+        kernel();
+        best = min(best, std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// Times the flip, RGB->RGBA and mip chain kernels against their scalar versions on a synthetic image,
+// checking that both produce the same bytes
+bool URunImageBenchmark()
+{
+    const int size = IMAGE_BENCHMARK_SIZE;
+    const size_t pixels = (size_t)size * size;
+
+    std::vector<unsigned char> rgb(pixels * 3);
+    uint32_t seed = 12345;
+    for (unsigned char& byte : rgb)
+    {
+        seed = seed * 1664525u + 1013904223u;
+        byte = (unsigned char)(seed >> 24);
+    }
+
+    std::vector<unsigned char> scalar(pixels * 4), simd(pixels * 4);
+    double expandScalar = UTimeImageKernel([&] { UExpandRgbToRgbaScalar(rgb.data(), scalar.data(), pixels); });
+    double expandSimd = UTimeImageKernel([&] { UExpandRgbToRgba(rgb.data(), simd.data(), pixels); });
+    bool matches = scalar == simd;
+
+    // Odd run count, so both images end up flipped the same number of times
+    double flipScalar = UTimeImageKernel([&] { UFlipImageScalar(scalar.data(), size, size, 4); });
+    double flipSimd = UTimeImageKernel([&] { flipImageVertically(simd.data(), size, size, 4); });
+    matches = matches && scalar == simd;
+
+    // Whole chain down to 1x1, each level written after the previous one
+    std::vector<unsigned char> scalarChain(pixels * 4 * 4 / 3 + 4), simdChain(scalarChain.size());
+    auto buildChain = [&](std::vector<unsigned char>& chain, void (*downsample)(const unsigned char*, int, int, unsigned char*))
+    {
+        memcpy(chain.data(), scalar.data(), pixels * 4);
+        unsigned char* level = chain.data();
+        for (int width = size; width > 1; width /= 2)
+        {
+            unsigned char* next = level + (size_t)width * width * 4;
+            downsample(level, width, width, next);
+            level = next;
+        }
+    };
+    double mipScalar = UTimeImageKernel([&] { buildChain(scalarChain, UDownsampleRgbaScalar); });
+    double mipSimd = UTimeImageKernel([&] { buildChain(simdChain, UDownsampleRgba); });
+    matches = matches && scalarChain == simdChain;
+
+    const char* isa =
+#if defined(USIMD_AVX2)
+        "avx2";
+#elif defined(USIMD_SSSE3)
+        "ssse3";
+#elif defined(USIMD_SSE2)
+        "sse2";
+#else
+        "scalar";
+#endif
+
+    cout << "IMAGE_BENCHMARK: size=" << size << "x" << size << " isa=" << isa << endl;
+    cout << "IMAGE_BENCHMARK: kernel=rgb_to_rgba scalar_ms=" << expandScalar << " simd_ms=" << expandSimd
+         << " speedup=" << expandScalar / expandSimd << endl;
+    cout << "IMAGE_BENCHMARK: kernel=flip scalar_ms=" << flipScalar << " simd_ms=" << flipSimd
+         << " speedup=" << flipScalar / flipSimd << endl;
+    cout << "IMAGE_BENCHMARK: kernel=mip_chain scalar_ms=" << mipScalar << " simd_ms=" << mipSimd
+         << " speedup=" << mipScalar / mipSimd << endl;
+
+    if (!matches)
+        cout << "IMAGE_BENCHMARK: SIMD output differs from the scalar path" << endl;
+    return matches;
+}
+
+
+// Open the CSV file and allocate the timer queries for every frame slot
+bool UInitTiming(const char* csvPath)
+{
+    gTimingCsv.open(csvPath);
+    if (!gTimingCsv)
+    {
+        cout << "Failed to open timing file: " << csvPath << endl;
+        return false;
+    }
+    gTimingCsv << "frame,stage,cpu_ms,gpu_ms\n";
+
+    for (int slot = 0; slot < TIMER_FRAME_LATENCY; ++slot)
+    {
+        for (int stage = 0; stage < MAX_TIMED_STAGES; ++stage)
+            glGenQueries(1, &gTimingFrames[slot].stages[stage].query);
+        gTimingFrames[slot].stageCount = 0;
+        gTimingFrames[slot].pending = false;
+    }
+
+    gTimingEnabled = true;
+    return true;
+}
+
+
+// Reuse the oldest frame slot, writing out its results first
+void UBeginTimingFrame()
+{
+    if (!gTimingEnabled)
+        return;
+
+    TimingFrame& timingFrame = gTimingFrames[gTimingFrame % TIMER_FRAME_LATENCY];
+    if (timingFrame.pending)
+        UResolveTimingFrame(timingFrame);
+
+    timingFrame.frame = gTimingFrame;
+    timingFrame.stageCount = 0;
+}
+
+
+// Start timing one draw function (stages must not nest, GL_TIME_ELAPSED queries cannot overlap)
+void UBeginStage(const char* name)
+{
+    if (!gTimingEnabled)
+        return;
+
+    TimingFrame& timingFrame = gTimingFrames[gTimingFrame % TIMER_FRAME_LATENCY];
+    if (timingFrame.stageCount == MAX_TIMED_STAGES)
+        return;
+
+    StageTiming& stage = timingFrame.stages[timingFrame.stageCount];
+    stage.name = name;
+    glBeginQuery(GL_TIME_ELAPSED, stage.query);
+    gStageStart = std::chrono::steady_clock::now();
+}
+
+
+// Stop timing the current draw function
+void UEndStage()
+{
+    if (!gTimingEnabled)
+        return;
+
+    TimingFrame& timingFrame = gTimingFrames[gTimingFrame % TIMER_FRAME_LATENCY];
+    if (timingFrame.stageCount == MAX_TIMED_STAGES)
+        return;
+
+    StageTiming& stage = timingFrame.stages[timingFrame.stageCount++];
+    stage.cpuMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - gStageStart).count();
+    glEndQuery(GL_TIME_ELAPSED);
+}
+
+
+// Mark the frame's queries as in flight and move to the next slot
+void UEndTimingFrame()
+{
+    if (!gTimingEnabled)
+        return;
+
+    gTimingFrames[gTimingFrame % TIMER_FRAME_LATENCY].pending = true;
+    ++gTimingFrame;
+}
+
+
+// Write one row per stage; by now the queries are TIMER_FRAME_LATENCY frames old and normally available
+void UResolveTimingFrame(TimingFrame& timingFrame)
+{
+    for (int i = 0; i < timingFrame.stageCount; ++i)
+    {
+        const StageTiming& stage = timingFrame.stages[i];
+
+        GLuint64 gpuNs = 0;
+        glGetQueryObjectui64v(stage.query, GL_QUERY_RESULT, &gpuNs);
+
+        gTimingCsv << timingFrame.frame << ',' << stage.name << ','
+                   << stage.cpuMs << ',' << gpuNs / 1.0e6 << '\n';
+    }
+
+    timingFrame.pending = false;
+}
+
+
+// Flush the frames still in flight and release the queries
+void UDestroyTiming()
+{
+    if (!gTimingEnabled)
+        return;
+
+    for (int i = 0; i < TIMER_FRAME_LATENCY; ++i)
+    {
+        TimingFrame& timingFrame = gTimingFrames[(gTimingFrame + i) % TIMER_FRAME_LATENCY];
+        if (timingFrame.pending)
+            UResolveTimingFrame(timingFrame);
+
+        for (int stage = 0; stage < MAX_TIMED_STAGES; ++stage)
+            glDeleteQueries(1, &timingFrame.stages[stage].query);
+    }
+
+    gTimingCsv.close();
+    gTimingEnabled = false;
+}
+
+
+// Shows the finished frame; offscreen frames stay in the framebuffer
+void UPresentFrame()
+{
+    if (!gHeadless)
+        glfwSwapBuffers(gWindow);
+}
+
+
+// Swap interval for the pacing mode, frame slots, and the first GPU clock calibration
+void UInitFramePacing()
+{
+    // Fixed rate paces itself; letting vsync round it to the display rate would defeat the point
+    glfwSwapInterval(gPacingMode == PACING_VSYNC ? 1 : 0);
+
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+    {
+        glGenQueries(1, &gFrameSlots[i].timestampQuery);
+        gFrameSlots[i].fence = 0;
+        gFrameSlots[i].pending = false;
+    }
+
+    UCalibrateGpuClock();
+    gLastLatencyReportMs = USteadyMs();
+    gNextFrameDeadline = std::chrono::steady_clock::now();
+
+    const char* modes[] = { "vsync", "uncapped", "fixed" };
+    cout << "INFO: Frame pacing " << modes[gPacingMode];
+    if (gPacingMode == PACING_FIXED)
+        cout << " at " << gTargetFps << " fps";
+    cout << ", at most " << gFramesInFlight << " frames in flight" << endl;
+}
+
+
+double USteadyMs()
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+// GL_TIMESTAMP and the steady clock run at the same rate but from different origins
+void UCalibrateGpuClock()
+{
+    GLint64 gpuNs = 0;
+    glGetInteger64v(GL_TIMESTAMP, &gpuNs);
+    gGpuClockOffsetMs = USteadyMs() - gpuNs / 1.0e6;
+}
+
+
+// Block until the GPU has finished the frame that last used this slot, then sleep out a fixed-rate frame
+void UBeginPacedFrame()
+{
+    FrameInFlight& slot = gFrameSlots[gPacedFrame % gFramesInFlight];
+    if (slot.pending)
+        UResolveFrameInFlight(slot);
+
+    if (gPacingMode == PACING_FIXED)
+    {
+        const auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(1.0 / gTargetFps));
+        auto now = std::chrono::steady_clock::now();
+
+        // Sleep most of the way and spin the last millisecond, which the scheduler cannot hit reliably
+        if (now < gNextFrameDeadline)
+        {
+            std::this_thread::sleep_until(gNextFrameDeadline - std::chrono::milliseconds(1));
+            while (std::chrono::steady_clock::now() < gNextFrameDeadline)
+                ;
+        }
+
+        // A frame that ran late starts a new schedule instead of rushing to catch up
+        now = std::chrono::steady_clock::now();
+        gNextFrameDeadline = (now - gNextFrameDeadline > period) ? now + period : gNextFrameDeadline + period;
+    }
+
+    // The caller polls events right after this, so latency is measured from the input sample, waits excluded
+    slot.inputMs = USteadyMs();
+}
+
+
+// Mark the end of the frame's commands, swap included, in its slot
+void UEndPacedFrame()
+{
+    FrameInFlight& slot = gFrameSlots[gPacedFrame % gFramesInFlight];
+    glQueryCounter(slot.timestampQuery, GL_TIMESTAMP);
+    slot.fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    slot.pending = true;
+    ++gPacedFrame;
+
+    if (USteadyMs() - gLastLatencyReportMs >= LATENCY_REPORT_SECONDS * 1000.0)
+        UReportLatency();
+}
+
+
+// Wait on the slot's fence, which is what limits the frames in flight, and record the frame's latency
+void UResolveFrameInFlight(FrameInFlight& slot)
+{
+    while (glClientWaitSync(slot.fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000) == GL_TIMEOUT_EXPIRED)
+        ;
+    glDeleteSync(slot.fence);
+    slot.fence = 0;
+    slot.pending = false;
+
+    // GPU time at which the frame and its swap had been executed, on the steady clock
+    GLuint64 gpuNs = 0;
+    glGetQueryObjectui64v(slot.timestampQuery, GL_QUERY_RESULT, &gpuNs);
+    gLatencySamples.push_back(gpuNs / 1.0e6 + gGpuClockOffsetMs - slot.inputMs);
+}
+
+
+// Median and p99 input-to-swap latency since the last report
+void UReportLatency()
+{
+    const double nowMs = USteadyMs();
+    if (!gLatencySamples.empty())
+    {
+        std::sort(gLatencySamples.begin(), gLatencySamples.end());
+        size_t p99Index = (size_t)(0.99 * (gLatencySamples.size() - 1) + 0.5);
+
+        cout << "LATENCY: frames=" << gLatencySamples.size()
+             << " fps=" << gLatencySamples.size() * 1000.0 / (nowMs - gLastLatencyReportMs)
+             << " frames_in_flight=" << gFramesInFlight
+             << " median_ms=" << gLatencySamples[gLatencySamples.size() / 2]
+             << " p99_ms=" << gLatencySamples[p99Index] << endl;
+    }
+
+    gLatencySamples.clear();
+    gLastLatencyReportMs = nowMs;
+    UCalibrateGpuClock();
+}
+
+
+void UDestroyFramePacing()
+{
+    for (int i = 0; i < MAX_FRAMES_IN_FLIGHT; ++i)
+    {
+        if (gFrameSlots[i].fence)
+            glDeleteSync(gFrameSlots[i].fence);
+        glDeleteQueries(1, &gFrameSlots[i].timestampQuery);
+    }
+}
+
+
+// process all input: query GLFW whether relevant keys are pressed/released this frame and react accordingly
+void UProcessInput(GLFWwindow* window)
+{
+    static const float cameraSpeed = 2.5f;
+
+    if (glfwGetKey(window, GLFW_KEY_ESCAPE) == GLFW_PRESS)
+        glfwSetWindowShouldClose(window, true);
+
+    if (glfwGetKey(window, GLFW_KEY_W) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(FORWARD, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_S) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(BACKWARD, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_A) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(LEFT, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_D) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(RIGHT, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_Q) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(DOWN, gDeltaTime);
+    if (glfwGetKey(window, GLFW_KEY_E) == GLFW_PRESS)
+        gCamera.ProcessKeyboard(UP, gDeltaTime);
+}
+
+void UResizeWindow(GLFWwindow* window, int width, int height)
+{
+    glViewport(0, 0, width, height);
+
+    // Minimizing reports 0x0; the targets keep their size until there is something to draw again
+    if (width <= 0 || height <= 0 || (width == gFramebufferWidth && height == gFramebufferHeight))
+        return;
+
+    gFramebufferWidth = width;
+    gFramebufferHeight = height;
+
+    // Screen-sized targets follow the framebuffer
+    if (gGBufferFbo)
+    {
+        UDestroyGBufferTargets();
+        if (!UCreateGBufferTargets(width, height))
+            glfwSetWindowShouldClose(window, true); // The programs were built for deferred shading; nowhere to draw
+    }
+    if (gHiZTexture)
+    {
+        UDestroyHiZTargets();
+        if (!UCreateHiZTargets(width, height))
+            gOcclusionCulling = false; // Keep drawing, just without occlusion culling
+    }
+}
+
+void UMousePositionCallback(GLFWwindow* window, double xpos, double ypos)
+{
+    if (gFirstMouse)
+    {
+        gLastX = xpos;
+        gLastY = ypos;
+        gFirstMouse = false;
+    }
+
+    float xoffset = xpos - gLastX;
+    float yoffset = gLastY - ypos; 
+
+    gLastX = xpos;
+    gLastY = ypos;
+
+    gCamera.ProcessMouseMovement(xoffset, yoffset);
+}
+
+
+void UMouseScrollCallback(GLFWwindow* window, double xoffset, double yoffset)
+{
+    gCamera.ProcessMouseScroll(yoffset);
+}
+
+
+void UMouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    switch (button)
+    {
+    case GLFW_MOUSE_BUTTON_LEFT:
+    {
+        if (action == GLFW_PRESS)
+        {
+            cout << "Left mouse button pressed" << endl;
+            UPickSceneObject();
+        }
+        else
+            cout << "Left mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_MIDDLE:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Middle mouse button pressed" << endl;
+        else
+            cout << "Middle mouse button released" << endl;
+    }
+    break;
+
+    case GLFW_MOUSE_BUTTON_RIGHT:
+    {
+        if (action == GLFW_PRESS)
+            cout << "Right mouse button pressed" << endl;
+        else
+            cout << "Right mouse button released" << endl;
+    }
+    break;
+
+    default:
+        cout << "Unhandled mouse button event" << endl;
+        break;
+    }
 }
 
 
@@ -492,357 +2357,1728 @@ void processView(GLFWwindow* window) {
         //std::cout << "P was pressed! Switching to ORTHO mode." << std::endl;
         gPerspectiveView = false;
     }
-    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS) {
-        //std::cout << "O was pressed! Switching to PERSPECTIVE mode." << std::endl;
-        gPerspectiveView = true;
+    if (glfwGetKey(window, GLFW_KEY_O) == GLFW_PRESS) {
+        //std::cout << "O was pressed! Switching to PERSPECTIVE mode." << std::endl;
+        gPerspectiveView = true;
+    }
+}
+
+
+// Projection for the current view mode
+glm::mat4 UProjectionMatrix() {
+    if (gPerspectiveView) {
+        // Creates perspective projection
+        return glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, NEAR_PLANE, FAR_PLANE);
+    }
+
+    // Creates ortho projection
+    return glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, NEAR_PLANE, FAR_PLANE);
+}
+
+
+// Allocate the per-frame uniform buffer and attach it to its binding point
+void UCreateFrameUniforms() {
+    glGenBuffers(1, &gFrameUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), NULL, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, FRAME_UBO_BINDING, gFrameUbo);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+// Upload camera, projection and cluster layout once per frame
+void UUpdateFrameUniforms() {
+    // Slice = log(depth) * scale + bias puts NEAR_PLANE at slice 0 and FAR_PLANE at CLUSTER_SLICES
+    const float sliceScale = CLUSTER_SLICES / log(FAR_PLANE / NEAR_PLANE);
+
+    FrameUniforms frame;
+    frame.view = gCamera.GetViewMatrix();
+    frame.projection = UProjectionMatrix();
+    frame.viewPosition = glm::vec4(gCamera.Position, 1.0f);
+    frame.ambientColor = glm::vec4(sideLightColor, 1.0f);
+    frame.clusterScale = glm::vec4(sliceScale, -log(NEAR_PLANE) * sliceScale,
+                                   (float)gFramebufferWidth / CLUSTER_TILES_X, (float)gFramebufferHeight / CLUSTER_TILES_Y);
+    frame.clusterCount = glm::uvec4(CLUSTER_TILES_X, CLUSTER_TILES_Y, CLUSTER_SLICES, 0);
+    frame.inverseViewProjection = glm::inverse(frame.projection * frame.view);
+    frame.shadowViewProjection = UShadowViewProjection();
+    frame.shadowParams = glm::vec4(gShadows ? 1.0f : 0.0f, 0.0f, 0.0f, 0.0f);
+
+    glBindBuffer(GL_UNIFORM_BUFFER, gFrameUbo);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(FrameUniforms), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+
+void UDestroyFrameUniforms() {
+    glDeleteBuffers(1, &gFrameUbo);
+}
+
+
+// Light and cluster buffers, the side light, and --lights scattered candles
+void UCreateLights() {
+    gLightCapacity = 16;
+    gLightIndexCapacity = 1024;
+
+    glGenBuffers(1, &gLightBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gLightBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gLightCapacity * sizeof(PointLight), NULL, GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_SSBO_BINDING, gLightBuffer);
+
+    glGenBuffers(1, &gClusterBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gClusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, CLUSTER_COUNT * sizeof(glm::uvec2), NULL, GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, CLUSTER_SSBO_BINDING, gClusterBuffer);
+
+    glGenBuffers(1, &gLightIndexBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gLightIndexBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gLightIndexCapacity * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, LIGHT_INDEX_SSBO_BINDING, gLightIndexBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    // The side light reaches the whole scene unattenuated, as before clustering
+    UAddLight(sideLightPosition, 2.0f * FAR_PLANE, sideLightColor, 0.0f, 0.0f);
+
+    if (gLightCount > 0)
+        UScatterLights(gLightCount);
+}
+
+int UAddLight(const glm::vec3& position, float radius, const glm::vec3& color, float falloff, float flicker) {
+    PointLight light;
+    light.positionRadius = glm::vec4(position, radius);
+    light.colorFalloff = glm::vec4(color, falloff);
+
+    gLights.push_back(light);
+    gLightColors.push_back(color);
+    gLightFlicker.push_back(flicker);
+    return (int)gLights.size() - 1;
+}
+
+// Warm, short-range candles around the desk, each marked with a small lamp cube
+void UScatterLights(int count) {
+    uint32_t seed = 1999;
+    auto random = [&seed](float low, float high) {
+        seed = seed * 1664525u + 1013904223u;
+        return low + (high - low) * ((seed >> 8) / 16777216.0f);
+    };
+
+    for (int i = 0; i < count; ++i) {
+        glm::vec3 position(random(-6.0f, 6.0f), random(0.3f, 1.5f), random(-6.0f, 6.0f));
+        glm::vec3 color = glm::vec3(1.0f, random(0.55f, 0.8f), random(0.25f, 0.45f)) * 1.5f;
+
+        UAddLight(position, random(2.0f, 4.0f), color, 1.0f, random(3.0f, 9.0f));
+        gLightTransforms.push_back(UCreateTransform(position, glm::vec3(0.0f, 1.0f, 0.0f), 0.0f, glm::vec3(0.06f), -1));
+    }
+
+    cout << "INFO: " << gLights.size() << " lights in " << CLUSTER_COUNT << " clusters" << endl;
+}
+
+// Flicker the candles, rebuild the cluster light lists for the current camera, and upload both
+void UUpdateLights() {
+    gLightTime += gDeltaTime;
+    for (size_t i = 0; i < gLights.size(); ++i) {
+        if (gLightFlicker[i] == 0.0f)
+            continue;
+        float phase = gLightTime * gLightFlicker[i] + (float)i;
+        float flicker = 0.85f + 0.1f * sinf(phase) + 0.05f * sinf(phase * 2.7f);
+        gLights[i].colorFalloff = glm::vec4(gLightColors[i] * flicker, gLights[i].colorFalloff.w);
+    }
+
+    UAssignLightClusters(gCamera.GetViewMatrix(), UProjectionMatrix());
+
+    // Orphan last frame's storage so the uploads do not wait for draws still reading it
+    while (gLightCapacity < gLights.size())
+        gLightCapacity *= 2;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gLightBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gLightCapacity * sizeof(PointLight), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, gLights.size() * sizeof(PointLight), gLights.data());
+
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gClusterBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, CLUSTER_COUNT * sizeof(glm::uvec2), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, CLUSTER_COUNT * sizeof(glm::uvec2), gClusters.data());
+
+    while (gLightIndexCapacity < gLightIndices.size())
+        gLightIndexCapacity *= 2;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gLightIndexBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gLightIndexCapacity * sizeof(GLuint), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, gLightIndices.size() * sizeof(GLuint), gLightIndices.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+}
+
+// Each light's view-space sphere covers a slice range from its depth extent and a tile range from its
+// projected bounding box; the cluster lists are then built with a count, prefix-sum and fill pass
+void UAssignLightClusters(const glm::mat4& view, const glm::mat4& projection) {
+    const float sliceScale = CLUSTER_SLICES / log(FAR_PLANE / NEAR_PLANE);
+    const float sliceBias = -log(NEAR_PLANE) * sliceScale;
+    auto sliceOf = [&](float depth) {
+        return glm::clamp((int)(log(max(depth, NEAR_PLANE)) * sliceScale + sliceBias), 0, CLUSTER_SLICES - 1);
+    };
+
+    gLightRanges.resize(gLights.size());
+    for (size_t i = 0; i < gLights.size(); ++i) {
+        const glm::vec4& light = gLights[i].positionRadius;
+        const float radius = light.w;
+        glm::vec3 center = glm::vec3(view * glm::vec4(glm::vec3(light), 1.0f));
+        LightClusterRange& range = gLightRanges[i];
+
+        // Empty range unless the sphere reaches the view volume
+        range = LightClusterRange{ 0, -1, 0, -1, 0, -1 };
+        const float nearest = -center.z - radius;
+        const float farthest = -center.z + radius;
+        if (farthest < NEAR_PLANE || nearest > FAR_PLANE)
+            continue;
+
+        range.minSlice = sliceOf(nearest);
+        range.maxSlice = sliceOf(farthest);
+
+        // A sphere crossing the near plane can cover any tile
+        if (nearest <= NEAR_PLANE) {
+            range.minX = 0;
+            range.maxX = CLUSTER_TILES_X - 1;
+            range.minY = 0;
+            range.maxY = CLUSTER_TILES_Y - 1;
+            continue;
+        }
+
+        glm::vec2 rectMin(FLT_MAX, FLT_MAX);
+        glm::vec2 rectMax(-FLT_MAX, -FLT_MAX);
+        for (int corner = 0; corner < 8; ++corner) {
+            glm::vec4 clip = projection * glm::vec4(center.x + ((corner & 1) ? radius : -radius),
+                                                    center.y + ((corner & 2) ? radius : -radius),
+                                                    center.z + ((corner & 4) ? radius : -radius), 1.0f);
+            rectMin = glm::vec2(min(rectMin.x, clip.x / clip.w), min(rectMin.y, clip.y / clip.w));
+            rectMax = glm::vec2(max(rectMax.x, clip.x / clip.w), max(rectMax.y, clip.y / clip.w));
+        }
+        if (rectMax.x < -1.0f || rectMin.x > 1.0f || rectMax.y < -1.0f || rectMin.y > 1.0f) {
+            range.maxSlice = -1;
+            continue;
+        }
+
+        range.minX = glm::clamp((int)((rectMin.x * 0.5f + 0.5f) * CLUSTER_TILES_X), 0, CLUSTER_TILES_X - 1);
+        range.maxX = glm::clamp((int)((rectMax.x * 0.5f + 0.5f) * CLUSTER_TILES_X), 0, CLUSTER_TILES_X - 1);
+        range.minY = glm::clamp((int)((rectMin.y * 0.5f + 0.5f) * CLUSTER_TILES_Y), 0, CLUSTER_TILES_Y - 1);
+        range.maxY = glm::clamp((int)((rectMax.y * 0.5f + 0.5f) * CLUSTER_TILES_Y), 0, CLUSTER_TILES_Y - 1);
+    }
+
+    // Count the lights of each cluster, turn the counts into offsets, then fill
+    gClusters.assign(CLUSTER_COUNT, glm::uvec2(0, 0));
+    for (const LightClusterRange& range : gLightRanges)
+        for (int slice = range.minSlice; slice <= range.maxSlice; ++slice)
+            for (int y = range.minY; y <= range.maxY; ++y)
+                for (int x = range.minX; x <= range.maxX; ++x)
+                    ++gClusters[(slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x].y;
+
+    GLuint offset = 0;
+    for (glm::uvec2& cluster : gClusters) {
+        cluster.x = offset;
+        offset += cluster.y;
+        cluster.y = 0;
+    }
+
+    gLightIndices.resize(offset);
+    for (size_t i = 0; i < gLightRanges.size(); ++i) {
+        const LightClusterRange& range = gLightRanges[i];
+        for (int slice = range.minSlice; slice <= range.maxSlice; ++slice)
+            for (int y = range.minY; y <= range.maxY; ++y)
+                for (int x = range.minX; x <= range.maxX; ++x) {
+                    glm::uvec2& cluster = gClusters[(slice * CLUSTER_TILES_Y + y) * CLUSTER_TILES_X + x];
+                    gLightIndices[cluster.x + cluster.y++] = (GLuint)i;
+                }
+    }
+}
+
+void UDestroyLights() {
+    glDeleteBuffers(1, &gLightBuffer);
+    glDeleteBuffers(1, &gClusterBuffer);
+    glDeleteBuffers(1, &gLightIndexBuffer);
+}
+
+
+// Queue one draw of a mesh with the given program and material
+void USubmitDraw(GLuint program, const GLDoubleMesh& mesh, GLuint material, const glm::mat4& model, const glm::vec2& uvScale) {
+    // Normal matrix once per instance instead of an inverse() per vertex
+    USubmitDraw(program, mesh, material, model, glm::transpose(glm::inverse(glm::mat3(model))), uvScale);
+}
+
+// Same, with a normal matrix the caller already has (e.g. cached in the transform store)
+void USubmitDraw(GLuint program, const GLDoubleMesh& mesh, GLuint material, const glm::mat4& model, const glm::mat3& normalMatrix, const glm::vec2& uvScale) {
+    // Draw with the fallback until the requested program has linked
+    program = UReadyProgram(program);
+
+    // View-space depth of the object's origin, quantized over the 100 unit far plane
+    glm::vec3 toObject = glm::vec3(model[3]) - gCamera.Position;
+    float depth = glm::clamp(glm::dot(toObject, gCamera.Front) / 100.0f, 0.0f, 1.0f);
+    uint64_t depthBits = (uint64_t)(depth * 0xFFFFFF);
+
+    Material placement = (material == NO_MATERIAL) ? Material{ 0, 0, 0 } : gMaterials[material];
+
+    // Dense slots rather than GL names, so distinct programs and arrays never share a key prefix; 0 is no texture
+    RenderPacket packet;
+    packet.key = ((uint64_t)gProgramSortIndices[program] << 56)
+               | ((uint64_t)(placement.textureArray ? placement.arrayIndex + 1 : 0) << 48)
+               | ((uint64_t)mesh.arenaId << 36)
+               | ((uint64_t)(placement.layer & 0xFF) << 28)
+               | (depthBits << 4);
+    packet.program = program;
+    packet.material = material;
+    packet.mesh = &mesh;
+    packet.instance.model = model;
+    packet.instance.uvScale = glm::vec4(uvScale.x, uvScale.y, 0.0f, 0.0f);
+
+    for (int column = 0; column < 3; ++column)
+        packet.instance.normalMatrix[column] = glm::vec4(normalMatrix[column], 0.0f);
+
+    gRenderQueue.push_back(packet);
+}
+
+
+// Drop queued packets whose world-space bounding sphere lies outside the view frustum or behind last frame's depth
+void UCullRenderQueue() {
+    const size_t count = gRenderQueue.size();
+    const size_t padded = (count + 7) & ~(size_t)7;
+    gCullX.resize(padded);
+    gCullY.resize(padded);
+    gCullZ.resize(padded);
+    gCullRadius.resize(padded);
+    gCullVisible.resize(padded);
+
+    for (size_t i = 0; i < count; ++i) {
+        const RenderPacket& packet = gRenderQueue[i];
+        const glm::mat4& model = packet.instance.model;
+
+        // The largest axis scale keeps the sphere conservative under non-uniform scaling
+        glm::vec3 center = glm::vec3(model * glm::vec4(packet.mesh->sphereCenter, 1.0f));
+        float scale = max(glm::length(glm::vec3(model[0])), max(glm::length(glm::vec3(model[1])), glm::length(glm::vec3(model[2]))));
+
+        gCullX[i] = center.x;
+        gCullY[i] = center.y;
+        gCullZ[i] = center.z;
+        gCullRadius[i] = packet.mesh->sphereRadius * scale;
+    }
+    for (size_t i = count; i < padded; ++i)
+        gCullX[i] = gCullY[i] = gCullZ[i] = gCullRadius[i] = 0.0f;
+
+    if (gFrustumCulling) {
+        glm::vec4 planes[6];
+        UExtractFrustumPlanes(UProjectionMatrix() * gCamera.GetViewMatrix(), planes);
+        UCullSpheres(planes, padded, gCullVisible.data());
+    }
+    else {
+        std::fill(gCullVisible.begin(), gCullVisible.end(), (uint8_t)1);
+    }
+
+    size_t kept = 0;
+    gCulledCount = 0;
+    gOccludedCount = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (!gCullVisible[i]) {
+            ++gCulledCount;
+            continue;
+        }
+        if (gOcclusionCulling && USphereOccluded(gCullX[i], gCullY[i], gCullZ[i], gCullRadius[i])) {
+            ++gOccludedCount;
+            continue;
+        }
+        gRenderQueue[kept++] = gRenderQueue[i];
+    }
+    gRenderQueue.resize(kept);
+}
+
+
+// Register a prop with the scene BVH; the tree is rebuilt on the next query, so bulk loads build once
+int UAddSceneObject(GLuint program, const GLDoubleMesh* mesh, const LodMesh* lods, GLuint material, const glm::mat4& model, const glm::vec2& uvScale) {
+    SceneObject object;
+    object.name = "prop";
+    object.transform = -1;
+    object.castsShadow = true;
+    object.program = program;
+    object.mesh = mesh;
+    object.lods = lods;
+    object.material = material;
+    object.model = model;
+    object.normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+    object.uvScale = uvScale;
+    object.leaf = -1;
+    object.dynamic = false;
+
+    const GLDoubleMesh& bounds = lods ? lods->levels[0] : *mesh;
+    UTransformBounds(bounds.boundsMin, bounds.boundsMax, model, object.boundsMin, object.boundsMax);
+
+    gSceneObjects.push_back(object);
+    gBvhDirty = true;
+    return (int)gSceneObjects.size() - 1;
+}
+
+
+// World AABB of a transformed local AABB: the center moves with the model, the extents through |model|
+void UTransformBounds(const glm::vec3& localMin, const glm::vec3& localMax, const glm::mat4& model, glm::vec3& worldMin, glm::vec3& worldMax) {
+    glm::vec3 center = glm::vec3(model * glm::vec4((localMin + localMax) * 0.5f, 1.0f));
+    glm::vec3 extent = (localMax - localMin) * 0.5f;
+
+    glm::vec3 worldExtent(0.0f);
+    for (int column = 0; column < 3; ++column)
+        worldExtent += glm::abs(glm::vec3(model[column])) * extent[column];
+
+    worldMin = center - worldExtent;
+    worldMax = center + worldExtent;
+}
+
+
+// Top-down build over every object, splitting at the median centroid along the widest axis
+void UBuildSceneBvh() {
+    gBvhNodes.clear();
+    gBvhNodes.reserve(gSceneObjects.size() * 2);
+    gBvhRoot = -1;
+    gBvhDirty = false;
+
+    if (gSceneObjects.empty())
+        return;
+
+    std::vector<int> objects(gSceneObjects.size());
+    for (size_t i = 0; i < objects.size(); ++i)
+        objects[i] = (int)i;
+
+    gBvhRoot = UBuildBvhNode(objects, 0, objects.size(), -1);
+}
+
+
+// Build the subtree over objects[first, last) and return its node index
+int UBuildBvhNode(std::vector<int>& objects, size_t first, size_t last, int parent) {
+    const int index = (int)gBvhNodes.size();
+    gBvhNodes.push_back(BvhNode());
+
+    BvhNode node;
+    node.parent = parent;
+    node.left = node.right = node.object = -1;
+
+    if (last - first == 1) {
+        SceneObject& object = gSceneObjects[objects[first]];
+        node.boundsMin = object.boundsMin;
+        node.boundsMax = object.boundsMax;
+        node.object = objects[first];
+        object.leaf = index;
+        gBvhNodes[index] = node;
+        return index;
+    }
+
+    glm::vec3 centroidMin(FLT_MAX), centroidMax(-FLT_MAX);
+    for (size_t i = first; i < last; ++i) {
+        const SceneObject& object = gSceneObjects[objects[i]];
+        glm::vec3 centroid = (object.boundsMin + object.boundsMax) * 0.5f;
+        centroidMin = glm::min(centroidMin, centroid);
+        centroidMax = glm::max(centroidMax, centroid);
+    }
+
+    glm::vec3 spread = centroidMax - centroidMin;
+    const int axis = (spread.x >= spread.y && spread.x >= spread.z) ? 0 : (spread.y >= spread.z ? 1 : 2);
+    const size_t middle = first + (last - first) / 2;
+    std::nth_element(objects.begin() + first, objects.begin() + middle, objects.begin() + last, [axis](int a, int b) {
+        return gSceneObjects[a].boundsMin[axis] + gSceneObjects[a].boundsMax[axis]
+             < gSceneObjects[b].boundsMin[axis] + gSceneObjects[b].boundsMax[axis];
+    });
+
+    // Children are built before the node is written, since building them grows gBvhNodes
+    node.left = UBuildBvhNode(objects, first, middle, index);
+    node.right = UBuildBvhNode(objects, middle, last, index);
+    node.boundsMin = glm::min(gBvhNodes[node.left].boundsMin, gBvhNodes[node.right].boundsMin);
+    node.boundsMax = glm::max(gBvhNodes[node.left].boundsMax, gBvhNodes[node.right].boundsMax);
+    gBvhNodes[index] = node;
+    return index;
+}
+
+
+// Move an object and refit the bounds of its ancestors; the topology stays, so this is cheap per frame
+void UMoveSceneObject(int object, const glm::mat4& model) {
+    SceneObject& sceneObject = gSceneObjects[object];
+    sceneObject.model = model;
+
+    // From now on it is drawn into the shadow map every frame; the cached map has to lose its old position once
+    if (!sceneObject.dynamic) {
+        sceneObject.dynamic = true;
+        gDynamicSceneObjects.push_back(object);
+        if (sceneObject.castsShadow)
+            gShadowStaticDirty = true;
+    }
+    sceneObject.normalMatrix = glm::transpose(glm::inverse(glm::mat3(model)));
+
+    const GLDoubleMesh& bounds = sceneObject.lods ? sceneObject.lods->levels[0] : *sceneObject.mesh;
+    UTransformBounds(bounds.boundsMin, bounds.boundsMax, model, sceneObject.boundsMin, sceneObject.boundsMax);
+
+    if (gBvhDirty || sceneObject.leaf < 0)
+        return; // The pending rebuild picks up the new bounds
+
+    int node = sceneObject.leaf;
+    gBvhNodes[node].boundsMin = sceneObject.boundsMin;
+    gBvhNodes[node].boundsMax = sceneObject.boundsMax;
+
+    for (node = gBvhNodes[node].parent; node >= 0; node = gBvhNodes[node].parent) {
+        const BvhNode& left = gBvhNodes[gBvhNodes[node].left];
+        const BvhNode& right = gBvhNodes[gBvhNodes[node].right];
+        gBvhNodes[node].boundsMin = glm::min(left.boundsMin, right.boundsMin);
+        gBvhNodes[node].boundsMax = glm::max(left.boundsMax, right.boundsMax);
+    }
+}
+
+
+// Append every object below a node
+void UCollectBvhLeaves(int node, std::vector<int>& results) {
+    const size_t stackBase = gBvhStack.size();
+    gBvhStack.push_back(node);
+
+    while (gBvhStack.size() > stackBase) {
+        const BvhNode& current = gBvhNodes[gBvhStack.back()];
+        gBvhStack.pop_back();
+
+        if (current.object >= 0) {
+            results.push_back(current.object);
+        }
+        else {
+            gBvhStack.push_back(current.left);
+            gBvhStack.push_back(current.right);
+        }
+    }
+}
+
+
+// Objects whose AABB touches the frustum; subtrees entirely inside are taken without further plane tests
+void USceneFrustumQuery(const glm::vec4* planes, std::vector<int>& results) {
+    if (gBvhDirty)
+        UBuildSceneBvh();
+    if (gBvhRoot < 0)
+        return;
+
+    gBvhStack.clear();
+    gBvhStack.push_back(gBvhRoot);
+
+    while (!gBvhStack.empty()) {
+        const int index = gBvhStack.back();
+        gBvhStack.pop_back();
+        const BvhNode& node = gBvhNodes[index];
+
+        // Per plane, the box corner furthest along the normal decides "outside", the nearest one "inside"
+        bool outside = false;
+        bool inside = true;
+        for (int plane = 0; plane < 6 && !outside; ++plane) {
+            const glm::vec3 normal(planes[plane]);
+            glm::vec3 farCorner(normal.x >= 0.0f ? node.boundsMax.x : node.boundsMin.x,
+                                normal.y >= 0.0f ? node.boundsMax.y : node.boundsMin.y,
+                                normal.z >= 0.0f ? node.boundsMax.z : node.boundsMin.z);
+            glm::vec3 nearCorner(normal.x >= 0.0f ? node.boundsMin.x : node.boundsMax.x,
+                                 normal.y >= 0.0f ? node.boundsMin.y : node.boundsMax.y,
+                                 normal.z >= 0.0f ? node.boundsMin.z : node.boundsMax.z);
+
+            outside = glm::dot(normal, farCorner) + planes[plane].w < 0.0f;
+            inside = inside && glm::dot(normal, nearCorner) + planes[plane].w >= 0.0f;
+        }
+
+        if (outside)
+            continue;
+
+        if (inside || node.object >= 0) {
+            UCollectBvhLeaves(index, results);
+        }
+        else {
+            gBvhStack.push_back(node.left);
+            gBvhStack.push_back(node.right);
+        }
+    }
+}
+
+
+// Objects whose AABB overlaps a sphere (e.g. a light's range)
+void USceneSphereQuery(const glm::vec3& center, float radius, std::vector<int>& results) {
+    if (gBvhDirty)
+        UBuildSceneBvh();
+    if (gBvhRoot < 0)
+        return;
+
+    gBvhStack.clear();
+    gBvhStack.push_back(gBvhRoot);
+
+    while (!gBvhStack.empty()) {
+        const BvhNode& node = gBvhNodes[gBvhStack.back()];
+        gBvhStack.pop_back();
+
+        glm::vec3 closest = glm::clamp(center, node.boundsMin, node.boundsMax);
+        glm::vec3 offset = closest - center;
+        if (glm::dot(offset, offset) > radius * radius)
+            continue;
+
+        if (node.object >= 0) {
+            results.push_back(node.object);
+        }
+        else {
+            gBvhStack.push_back(node.left);
+            gBvhStack.push_back(node.right);
+        }
+    }
+}
+
+
+// Nearest object whose AABB the ray enters within maxDistance (picking); -1 when nothing is hit
+int USceneRayQuery(const glm::vec3& origin, const glm::vec3& direction, float maxDistance, float& hitDistance) {
+    if (gBvhDirty)
+        UBuildSceneBvh();
+
+    int hitObject = -1;
+    hitDistance = maxDistance;
+    if (gBvhRoot < 0)
+        return hitObject;
+
+    // A huge finite inverse for axis-parallel rays: with inf, an origin on a slab plane gives 0 * inf = NaN
+    glm::vec3 inverseDirection;
+    for (int axis = 0; axis < 3; ++axis)
+        inverseDirection[axis] = (direction[axis] != 0.0f) ? 1.0f / direction[axis] : FLT_MAX;
+
+    gBvhStack.clear();
+    gBvhStack.push_back(gBvhRoot);
+
+    while (!gBvhStack.empty()) {
+        const BvhNode& node = gBvhNodes[gBvhStack.back()];
+        gBvhStack.pop_back();
+
+        // Nodes entered beyond the closest hit so far cannot improve it
+        float entry;
+        if (!URayHitsBox(origin, inverseDirection, node.boundsMin, node.boundsMax, hitDistance, entry))
+            continue;
+
+        if (node.object >= 0) {
+            hitObject = node.object;
+            hitDistance = entry;
+        }
+        else {
+            gBvhStack.push_back(node.left);
+            gBvhStack.push_back(node.right);
+        }
+    }
+    return hitObject;
+}
+
+
+// Slab test; entry is the distance at which the ray enters the box (0 when it starts inside)
+bool URayHitsBox(const glm::vec3& origin, const glm::vec3& inverseDirection, const glm::vec3& boxMin, const glm::vec3& boxMax, float maxDistance, float& entry) {
+    glm::vec3 t0 = (boxMin - origin) * inverseDirection;
+    glm::vec3 t1 = (boxMax - origin) * inverseDirection;
+    glm::vec3 tNear = glm::min(t0, t1);
+    glm::vec3 tFar = glm::max(t0, t1);
+
+    entry = max(0.0f, max(tNear.x, max(tNear.y, tNear.z)));
+    float exit = min(maxDistance, min(tFar.x, min(tFar.y, tFar.z)));
+    return entry <= exit;
+}
+
+
+// Scatter mugs and wand boxes on a ring around the desk to load the scene with many props
+void UScatterProps(int count) {
+    uint32_t seed = 2024;
+    auto random = [&seed](float low, float high) {
+        seed = seed * 1664525u + 1013904223u;
+        return low + (high - low) * ((seed >> 8) / 16777216.0f);
+    };
+
+    const float extent = max(10.0f, sqrtf((float)count) * 1.5f);
+    for (int i = 0; i < count; ++i) {
+        float x, z;
+        do {
+            x = random(-extent, extent);
+            z = random(-extent, extent);
+        } while (fabsf(x) < 6.0f && fabsf(z) < 6.0f); // Keep the desk clear
+
+        glm::mat4 model = glm::translate(glm::vec3(x, 0.0f, z)) * glm::rotate(random(0.0f, 6.283f), glm::vec3(0.0f, 1.0f, 0.0f));
+        if (i % 2 == 0)
+            UAddSceneObject(gProgramId, nullptr, &mugLods, mugMaterial, model * glm::scale(glm::vec3(0.35f, 1.0f, 0.35f)), glm::vec2(1.0f, 1.0f));
+        else
+            UAddSceneObject(gProgramId, &wandBoxMesh, nullptr, greenLeatherMaterial, model * glm::scale(glm::vec3(0.75f, 1.0f, 3.0f)), glm::vec2(1.0f, 1.0f));
+    }
+
+    UBuildSceneBvh();
+    cout << "INFO: Scene BVH holds " << gSceneObjects.size() << " objects in " << gBvhNodes.size() << " nodes" << endl;
+}
+
+
+// Register an object that follows a transform store entry; its world matrix must already be built
+int UAddDeskObject(const char* name, int transform, GLuint program, const GLDoubleMesh* mesh, const LodMesh* lods, GLuint material, const glm::vec2& uvScale, bool castsShadow) {
+    const int object = UAddSceneObject(program, mesh, lods, material, gTransforms.world[transform], uvScale);
+    gSceneObjects[object].name = name;
+    gSceneObjects[object].transform = transform;
+    gSceneObjects[object].castsShadow = castsShadow;
+
+    if (gTransformSceneObjects.size() <= (size_t)transform)
+        gTransformSceneObjects.resize(transform + 1, -1);
+    gTransformSceneObjects[transform] = object;
+    return object;
+}
+
+
+// Desk objects and lamp cubes, with the texture scale proportional to each object
+void UAddDeskObjects() {
+    // Build the initial world matrices now, so later rebuilds are real moves
+    UUpdateTransforms();
+
+    UAddDeskObject("side light", gLightTransform, gLightProgramId, &lMesh, nullptr, NO_MATERIAL, glm::vec2(1.0f, 1.0f), false);
+    for (int transform : gLightTransforms)
+        UAddDeskObject("lamp", transform, gLightProgramId, &lMesh, nullptr, NO_MATERIAL, glm::vec2(1.0f, 1.0f), false);
+
+    UAddDeskObject("floor", gPlaneTransform, gProgramId, &planeMesh, nullptr, woodFloorMaterial, glm::vec2(1.0f, 1.0f), true);
+    UAddDeskObject("wand box", gWandboxTransform, gProgramId, &wandBoxMesh, nullptr, greenLeatherMaterial, glm::vec2(1.0f, 1.0f), true);
+    UAddDeskObject("book cover", gCoverTransform, gProgramId, &bookCoverMesh, nullptr, bookCoverMaterial, glm::vec2(1.0f, 1.0f), true);
+    UAddDeskObject("book pages", gPagesTransform, gProgramId, &pagesMesh, nullptr, bookPagesMaterial, glm::vec2(1.0f, 0.1f), true);
+    for (int part : gWandPartTransforms)
+        UAddDeskObject("wand", part, gProgramId, nullptr, &cylinderLods, wandWoodMaterial, glm::vec2(1.0f, 1.0f), true);
+    UAddDeskObject("mug", gMugTransform, gProgramId, nullptr, &mugLods, mugMaterial, glm::vec2(1.0f, 1.0f), true);
+}
+
+
+// --animate: turn the wand about its own axis; the parts follow it as children
+void UAnimateScene() {
+    if (!gAnimate)
+        return;
+
+    const float seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() - gAnimationStart).count();
+    USetTransformRotation(gWandTransform, gTransforms.rotationAxis[gWandTransform], gWandBaseAngle + seconds);
+}
+
+
+// Move the objects whose transform was rebuilt this frame; refits their BVH leaves
+void USyncSceneTransforms() {
+    for (int transform : gRebuiltTransforms) {
+        if ((size_t)transform < gTransformSceneObjects.size() && gTransformSceneObjects[transform] >= 0)
+            UMoveSceneObject(gTransformSceneObjects[transform], gTransforms.world[transform]);
+    }
+}
+
+
+// Report the nearest object under the crosshair. The cursor is captured for mouse look, so the pick ray is the
+// view direction through the center of the screen
+void UPickSceneObject() {
+    float hitDistance;
+    const int object = USceneRayQuery(gCamera.Position, gCamera.Front, FAR_PLANE, hitDistance);
+    if (object < 0)
+        cout << "Picked nothing" << endl;
+    else
+        cout << "Picked " << gSceneObjects[object].name << " (object " << object << ") at distance " << hitDistance << endl;
+}
+
+
+// Queue the objects the BVH finds inside the view frustum
+void UDrawSceneObjects() {
+    if (gSceneObjects.empty())
+        return;
+
+    glm::vec4 planes[6];
+    UExtractFrustumPlanes(UProjectionMatrix() * gCamera.GetViewMatrix(), planes);
+
+    gSceneQueryResults.clear();
+    USceneFrustumQuery(planes, gSceneQueryResults);
+
+    for (int index : gSceneQueryResults) {
+        const SceneObject& object = gSceneObjects[index];
+        const GLDoubleMesh& mesh = object.lods ? USelectLod(*object.lods, object.model) : *object.mesh;
+        USubmitDraw(object.program, mesh, object.material, object.model, object.normalMatrix, object.uvScale);
+    }
+}
+
+
+// Cached static and per-frame shadow maps of the side light, each with a depth-only framebuffer
+bool UCreateShadowMaps()
+{
+    struct { GLuint* texture; GLuint* fbo; } targets[] = {
+        { &gStaticShadowMap, &gStaticShadowFbo },
+        { &gShadowMap, &gShadowFbo }
+    };
+    for (auto& target : targets)
+    {
+        glGenTextures(1, target.texture);
+        glBindTexture(GL_TEXTURE_2D, *target.texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_MODE, GL_COMPARE_REF_TO_TEXTURE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_COMPARE_FUNC, GL_LEQUAL);
+
+        // Outside the map counts as lit
+        const GLfloat border[] = { 1.0f, 1.0f, 1.0f, 1.0f };
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
+        glTexParameterfv(GL_TEXTURE_2D, GL_TEXTURE_BORDER_COLOR, border);
+
+        glGenFramebuffers(1, target.fbo);
+        glBindFramebuffer(GL_FRAMEBUFFER, *target.fbo);
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, *target.texture, 0);
+        glDrawBuffer(GL_NONE);
+        glReadBuffer(GL_NONE);
+
+        const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+        glClear(GL_DEPTH_BUFFER_BIT); // Unshadowed until the first render
+        if (!complete)
+        {
+            glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+            std::cout << "ERROR::FRAMEBUFFER::SHADOW_MAP_INCOMPLETE" << std::endl;
+            return false;
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+
+    // The lit programs sample the shadow map from their own unit, untouched by the draw path
+    glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, gStaticShadowMap);
+    glActiveTexture(GL_TEXTURE0);
+    return true;
+}
+
+
+// Spot projection from the side light onto the desk
+glm::mat4 UShadowViewProjection()
+{
+    return glm::perspective(glm::radians(90.0f), 1.0f, 0.5f, SHADOW_FAR_PLANE)
+         * glm::lookAt(sideLightPosition, glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 1.0f, 0.0f));
+}
+
+
+// Re-render the static map when a static caster or the light changed; composite moving casters every frame
+void UUpdateShadowMaps()
+{
+    // Wait for the real depth-only program rather than caching the fallback's output
+    if (UReadyProgram(gShadowProgramId) != gShadowProgramId)
+        return;
+
+    // Moved objects already left the static set through UMoveSceneObject; only the light invalidates it here
+    if (sideLightPosition != gShadowLightPosition)
+        gShadowStaticDirty = true;
+
+    if (gShadowStaticDirty)
+    {
+        // Objects in the light's range that never moved, at full detail since the map outlives the camera
+        gSceneQueryResults.clear();
+        USceneSphereQuery(sideLightPosition, SHADOW_FAR_PLANE, gSceneQueryResults);
+        for (int index : gSceneQueryResults)
+        {
+            const SceneObject& object = gSceneObjects[index];
+            if (object.castsShadow && !object.dynamic)
+                USubmitDraw(gShadowProgramId, object.lods ? object.lods->levels[0] : *object.mesh, NO_MATERIAL, object.model, object.normalMatrix, object.uvScale);
+        }
+
+        URenderShadowCasters(gStaticShadowFbo, true);
+        gShadowLightPosition = sideLightPosition;
+        gShadowStaticDirty = false;
+        ++gStaticShadowRenders;
+    }
+
+    // Nothing moves: sample the cached map directly
+    GLuint shadowMap = gStaticShadowMap;
+    if (!gDynamicSceneObjects.empty())
+    {
+        glCopyImageSubData(gStaticShadowMap, GL_TEXTURE_2D, 0, 0, 0, 0, gShadowMap, GL_TEXTURE_2D, 0, 0, 0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE, 1);
+
+        for (int index : gDynamicSceneObjects)
+        {
+            const SceneObject& object = gSceneObjects[index];
+            if (object.castsShadow)
+                USubmitDraw(gShadowProgramId, object.lods ? object.lods->levels[0] : *object.mesh, NO_MATERIAL, object.model, object.normalMatrix, object.uvScale);
+        }
+        URenderShadowCasters(gShadowFbo, false);
+        shadowMap = gShadowMap;
+    }
+
+    glActiveTexture(GL_TEXTURE0 + SHADOW_TEXTURE_UNIT);
+    glBindTexture(GL_TEXTURE_2D, shadowMap);
+    glActiveTexture(GL_TEXTURE0);
+}
+
+
+// Draw the queued casters into a shadow map. Culling is camera-based, so this is not a camera pass
+void URenderShadowCasters(GLuint fbo, bool clear)
+{
+    GLint viewport[4];
+    glGetIntegerv(GL_VIEWPORT, viewport);
+
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    glViewport(0, 0, SHADOW_MAP_SIZE, SHADOW_MAP_SIZE);
+    if (clear)
+        glClear(GL_DEPTH_BUFFER_BIT);
+
+    // Slope-scaled bias against self-shadowing
+    glEnable(GL_DEPTH_TEST);
+    glEnable(GL_POLYGON_OFFSET_FILL);
+    glPolygonOffset(2.0f, 4.0f);
+
+    UExecuteRenderQueue(false);
+
+    glDisable(GL_POLYGON_OFFSET_FILL);
+    glViewport(viewport[0], viewport[1], viewport[2], viewport[3]);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+}
+
+
+void UDestroyShadowMaps()
+{
+    glDeleteFramebuffers(1, &gStaticShadowFbo);
+    glDeleteFramebuffers(1, &gShadowFbo);
+    glDeleteTextures(1, &gStaticShadowMap);
+    glDeleteTextures(1, &gShadowMap);
+}
+
+
+// G-buffer and the empty VAO the full-screen pass draws with
+bool UCreateGBuffer(int width, int height)
+{
+    if (!UCreateGBufferTargets(width, height))
+        return false;
+
+    glGenVertexArrays(1, &gFullScreenVao);
+
+    cout << "INFO: Deferred shading with a " << width << "x" << height << " G-buffer" << endl;
+    return true;
+}
+
+
+// G-buffer textures and framebuffer for the deferred geometry pass, at the frame's size; recreated on resize
+bool UCreateGBufferTargets(int width, int height)
+{
+    struct { GLuint* texture; GLenum format; } targets[] = {
+        { &gGBufferAlbedo, GL_RGBA8 },
+        { &gGBufferNormal, GL_RG16 },
+        { &gGBufferDepth, GL_DEPTH24_STENCIL8 }
+    };
+    for (auto& target : targets)
+    {
+        glGenTextures(1, target.texture);
+        glBindTexture(GL_TEXTURE_2D, *target.texture);
+        glTexStorage2D(GL_TEXTURE_2D, 1, target.format, width, height);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    glGenFramebuffers(1, &gGBufferFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gGBufferFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, gGBufferAlbedo, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, gGBufferNormal, 0);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, gGBufferDepth, 0);
+
+    const GLenum drawBuffers[] = { GL_COLOR_ATTACHMENT0, GL_COLOR_ATTACHMENT1 };
+    glDrawBuffers(2, drawBuffers);
+
+    const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+    if (!complete)
+    {
+        std::cout << "ERROR::FRAMEBUFFER::GBUFFER_INCOMPLETE" << std::endl;
+        return false;
+    }
+    return true;
+}
+
+
+// Full-screen lighting pass from the G-buffer into the frame
+void UDeferredLighting()
+{
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+
+    // The overdraw counts went to the albedo target; show them as they are
+    if (gOverdrawView)
+    {
+        glBindFramebuffer(GL_READ_FRAMEBUFFER, gGBufferFbo);
+        glReadBuffer(GL_COLOR_ATTACHMENT0);
+        glBlitFramebuffer(0, 0, gFramebufferWidth, gFramebufferHeight, 0, 0, gFramebufferWidth, gFramebufferHeight, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+        return;
+    }
+
+    // Until the lighting program links the frame shows just the background
+    if (UReadyProgram(gDeferredLightingProgramId) != gDeferredLightingProgramId)
+        return;
+
+    glUseProgram(gDeferredLightingProgramId);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, gGBufferAlbedo);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, gGBufferNormal);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, gGBufferDepth);
+    glActiveTexture(GL_TEXTURE0);
+
+    glDisable(GL_DEPTH_TEST);
+    glBindVertexArray(gFullScreenVao);
+    glDrawArrays(GL_TRIANGLES, 0, 3);
+    glEnable(GL_DEPTH_TEST);
+}
+
+
+void UDestroyGBuffer()
+{
+    glDeleteVertexArrays(1, &gFullScreenVao);
+    UDestroyGBufferTargets();
+}
+
+
+void UDestroyGBufferTargets()
+{
+    glDeleteFramebuffers(1, &gGBufferFbo);
+    glDeleteTextures(1, &gGBufferAlbedo);
+    glDeleteTextures(1, &gGBufferNormal);
+    glDeleteTextures(1, &gGBufferDepth);
+    gGBufferFbo = gGBufferAlbedo = gGBufferNormal = gGBufferDepth = 0;
+}
+
+
+// Compile and link a compute-only program
+bool UCreateComputeProgram(const char* computeShaderSource, GLuint& programId)
+{
+    int success = 0;
+    char infoLog[512];
+
+    GLuint computeShaderId = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(computeShaderId, 1, &computeShaderSource, NULL);
+    glCompileShader(computeShaderId);
+    glGetShaderiv(computeShaderId, GL_COMPILE_STATUS, &success);
+    if (!success)
+    {
+        glGetShaderInfoLog(computeShaderId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::COMPUTE::COMPILATION_FAILED\n" << infoLog << std::endl;
+        glDeleteShader(computeShaderId);
+        return false;
+    }
+
+    programId = glCreateProgram();
+    glAttachShader(programId, computeShaderId);
+    glLinkProgram(programId);
+    glDeleteShader(computeShaderId);
+
+    glGetProgramiv(programId, GL_LINK_STATUS, &success);
+    if (!success)
+    {
+        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+        return false;
+    }
+
+    return true;
+}
+
+
+// Reduction program and frame-sized targets for Hi-Z culling
+bool UCreateHiZ(int width, int height)
+{
+    if (!UCreateComputeProgram(hiZComputeShaderSource, gHiZProgramId))
+        return false;
+
+    return UCreateHiZTargets(width, height);
+}
+
+
+// Depth copy target, GPU pyramid and readback buffer for a frame of the given size; recreated on resize
+bool UCreateHiZTargets(int width, int height)
+{
+    glGenTextures(1, &gHiZDepthTexture);
+    glBindTexture(GL_TEXTURE_2D, gHiZDepthTexture);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH24_STENCIL8, width, height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    glGenFramebuffers(1, &gHiZDepthFbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, gHiZDepthFbo);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_STENCIL_ATTACHMENT, GL_TEXTURE_2D, gHiZDepthTexture, 0);
+    const bool complete = glCheckFramebufferStatus(GL_FRAMEBUFFER) == GL_FRAMEBUFFER_COMPLETE;
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+    if (!complete)
+    {
+        std::cout << "ERROR::FRAMEBUFFER::HIZ_DEPTH_INCOMPLETE" << std::endl;
+        return false;
+    }
+
+    // Only the levels down to the readback are built on the GPU; the CPU finishes the pyramid
+    glGenTextures(1, &gHiZTexture);
+    glBindTexture(GL_TEXTURE_2D, gHiZTexture);
+    glTexStorage2D(GL_TEXTURE_2D, HIZ_READBACK_LEVEL + 1, GL_R32F, max(1, width / 2), max(1, height / 2));
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    const int readbackWidth = max(1, (width / 2) >> HIZ_READBACK_LEVEL);
+    const int readbackHeight = max(1, (height / 2) >> HIZ_READBACK_LEVEL);
+    glGenBuffers(1, &gHiZReadback);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, gHiZReadback);
+    glBufferData(GL_PIXEL_PACK_BUFFER, readbackWidth * readbackHeight * sizeof(float), NULL, GL_STREAM_READ);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+    // CPU levels from the readback size down to 1x1
+    gHiZLevels.clear();
+    for (int levelWidth = readbackWidth, levelHeight = readbackHeight; ; levelWidth = max(1, levelWidth / 2), levelHeight = max(1, levelHeight / 2))
+    {
+        HiZLevel level = { levelWidth, levelHeight, std::vector<float>(levelWidth * levelHeight, 1.0f) };
+        gHiZLevels.push_back(level);
+        if (levelWidth == 1 && levelHeight == 1)
+            break;
+    }
+
+    // Nothing is occluded until the first readback arrives
+    gHiZViewProjection = glm::mat4(0.0f);
+    return true;
+}
+
+
+// Copy the frame's depth, reduce it to the pyramid, and start reading the coarse level back
+void UBuildHiZ()
+{
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, gDeferred ? gGBufferFbo : gOffscreenFbo);
+    glBindFramebuffer(GL_DRAW_FRAMEBUFFER, gHiZDepthFbo);
+    glBlitFramebuffer(0, 0, gFramebufferWidth, gFramebufferHeight, 0, 0, gFramebufferWidth, gFramebufferHeight, GL_DEPTH_BUFFER_BIT, GL_NEAREST);
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
+
+    glUseProgram(gHiZProgramId);
+    glActiveTexture(GL_TEXTURE0);
+    const GLint sourceLevelLoc = glGetUniformLocation(gHiZProgramId, "sourceLevel");
+
+    for (int level = 0; level <= HIZ_READBACK_LEVEL; ++level)
+    {
+        glBindTexture(GL_TEXTURE_2D, level == 0 ? gHiZDepthTexture : gHiZTexture);
+        glUniform1i(sourceLevelLoc, level == 0 ? 0 : level - 1);
+        glBindImageTexture(0, gHiZTexture, level, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+
+        const int levelWidth = max(1, (gFramebufferWidth / 2) >> level);
+        const int levelHeight = max(1, (gFramebufferHeight / 2) >> level);
+        glDispatchCompute((levelWidth + 7) / 8, (levelHeight + 7) / 8, 1);
+        glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_TEXTURE_UPDATE_BARRIER_BIT);
+    }
+
+    // One readback in flight at a time; a slow GPU just refreshes the CPU pyramid less often
+    if (!gHiZFence)
+    {
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, gHiZReadback);
+        glBindTexture(GL_TEXTURE_2D, gHiZTexture);
+        glGetTexImage(GL_TEXTURE_2D, HIZ_READBACK_LEVEL, GL_RED, GL_FLOAT, 0);
+        glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+        gHiZFence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        gHiZPendingViewProjection = UProjectionMatrix() * gCamera.GetViewMatrix();
+    }
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+}
+
+
+// Without waiting: when the readback has landed, copy it in and build the rest of the pyramid on the CPU
+void UResolveHiZReadback()
+{
+    if (!gHiZFence)
+        return;
+
+    GLenum status = glClientWaitSync(gHiZFence, 0, 0);
+    if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+        return;
+
+    glDeleteSync(gHiZFence);
+    gHiZFence = 0;
+
+    HiZLevel& base = gHiZLevels[0];
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, gHiZReadback);
+    const float* depth = (const float*)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, base.depth.size() * sizeof(float), GL_MAP_READ_BIT);
+    if (depth)
+    {
+        memcpy(base.depth.data(), depth, base.depth.size() * sizeof(float));
+        glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    if (!depth)
+        return;
+
+    // Same max reduction as the compute shader, odd sizes folding the leftover texel into the last one
+    for (size_t i = 1; i < gHiZLevels.size(); ++i)
+    {
+        const HiZLevel& source = gHiZLevels[i - 1];
+        HiZLevel& level = gHiZLevels[i];
+        for (int y = 0; y < level.height; ++y)
+        {
+            const int lastY = (y == level.height - 1) ? source.height - 1 : min(2 * y + 1, source.height - 1);
+            for (int x = 0; x < level.width; ++x)
+            {
+                const int lastX = (x == level.width - 1) ? source.width - 1 : min(2 * x + 1, source.width - 1);
+                float farthest = 0.0f;
+                for (int sy = 2 * y; sy <= lastY; ++sy)
+                    for (int sx = 2 * x; sx <= lastX; ++sx)
+                        farthest = max(farthest, source.depth[sy * source.width + sx]);
+                level.depth[y * level.width + x] = farthest;
+            }
+        }
     }
+
+    gHiZViewProjection = gHiZPendingViewProjection;
 }
 
 
-// Update camera
-void updateCamera(glm::mat4 model) {
-    glm::mat4 view = gCamera.GetViewMatrix();
-    glm::mat4 projection; 
+// A sphere is occluded when its nearest depth lies behind the farthest depth of every pyramid texel its screen
+// rectangle covers. It is projected with the camera the depth was rendered with, so a still camera is exact
+bool USphereOccluded(float x, float y, float z, float radius)
+{
+    glm::vec2 rectMin(1.0f, 1.0f);
+    glm::vec2 rectMax(-1.0f, -1.0f);
+    float nearest = 1.0f;
+
+    for (int corner = 0; corner < 8; ++corner)
+    {
+        glm::vec4 clip = gHiZViewProjection * glm::vec4(x + ((corner & 1) ? radius : -radius),
+                                                         y + ((corner & 2) ? radius : -radius),
+                                                         z + ((corner & 4) ? radius : -radius), 1.0f);
+        if (clip.w <= 1e-4f)
+            return false; // Crosses the camera plane (or no readback yet)
+
+        glm::vec3 ndc = glm::vec3(clip) * (1.0f / clip.w);
+        rectMin = glm::vec2(min(rectMin.x, ndc.x), min(rectMin.y, ndc.y));
+        rectMax = glm::vec2(max(rectMax.x, ndc.x), max(rectMax.y, ndc.y));
+        nearest = min(nearest, ndc.z * 0.5f + 0.5f);
+    }
+
+    // Pixels of the frame, then texels of the read-back level (each covers 2^(level+1) pixels per side)
+    const HiZLevel& base = gHiZLevels[0];
+    const float texelPixels = (float)(2 << HIZ_READBACK_LEVEL);
+    float x0 = glm::clamp((rectMin.x * 0.5f + 0.5f) * gFramebufferWidth / texelPixels, 0.0f, (float)(base.width - 1));
+    float x1 = glm::clamp((rectMax.x * 0.5f + 0.5f) * gFramebufferWidth / texelPixels, 0.0f, (float)(base.width - 1));
+    float y0 = glm::clamp((rectMin.y * 0.5f + 0.5f) * gFramebufferHeight / texelPixels, 0.0f, (float)(base.height - 1));
+    float y1 = glm::clamp((rectMax.y * 0.5f + 0.5f) * gFramebufferHeight / texelPixels, 0.0f, (float)(base.height - 1));
+
+    // The level where the rectangle spans about two texels keeps the lookup to a handful of reads
+    int level = (int)ceil(log2(max(1.0f, max(x1 - x0, y1 - y0))));
+    level = min(level, (int)gHiZLevels.size() - 1);
+    const HiZLevel& hiZ = gHiZLevels[level];
 
-    if (gPerspectiveView) {
-        // Creates perspective projection
-        projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
-    }
-    else {
-        // Creates ortho projection
-        projection = glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, 0.1f, 100.0f);
-    }
+    const int ix0 = min((int)x0 >> level, hiZ.width - 1), ix1 = min((int)x1 >> level, hiZ.width - 1);
+    const int iy0 = min((int)y0 >> level, hiZ.height - 1), iy1 = min((int)y1 >> level, hiZ.height - 1);
 
-    // Shader selection
-    glUseProgram(gProgramId);
+    float farthest = 0.0f;
+    for (int ty = iy0; ty <= iy1; ++ty)
+        for (int tx = ix0; tx <= ix1; ++tx)
+            farthest = max(farthest, hiZ.depth[ty * hiZ.width + tx]);
 
-    // Retrieves and passes transform matrices to the Shader program
-    GLint modelLoc = glGetUniformLocation(gProgramId, "model");
-    GLint viewLoc = glGetUniformLocation(gProgramId, "view");
-    GLint projLoc = glGetUniformLocation(gProgramId, "projection");
+    return nearest > farthest;
+}
 
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
 
-    GLint objectColorLoc = glGetUniformLocation(gProgramId, "objectColor");
-    GLint lightColorLoc = glGetUniformLocation(gProgramId, "lightColor");
-    GLint lightPositionLoc = glGetUniformLocation(gProgramId, "lightPos");
-    GLint viewPositionLoc = glGetUniformLocation(gProgramId, "viewPosition");
+void UDestroyHiZ()
+{
+    UDestroyHiZTargets();
+    glDeleteProgram(gHiZProgramId);
+}
 
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, headLightColor.r, headLightColor.g, headLightColor.b);
-    glUniform3f(lightPositionLoc, headLightPosition.x, headLightPosition.y, headLightPosition.z);
-    const glm::vec3 cameraPosition = gCamera.Position;
-    glUniform3f(viewPositionLoc, cameraPosition.x, cameraPosition.y, cameraPosition.z);
 
-    glUniform3f(objectColorLoc, gObjectColor.r, gObjectColor.g, gObjectColor.b);
-    glUniform3f(lightColorLoc, sideLightColor.r, sideLightColor.g, sideLightColor.b);
-    glUniform3f(lightPositionLoc, sideLightPosition.x, sideLightPosition.y, sideLightPosition.z);
+// A readback still in flight has the old size, so it is dropped with the targets
+void UDestroyHiZTargets()
+{
+    if (gHiZFence)
+        glDeleteSync(gHiZFence);
+    gHiZFence = 0;
+
+    glDeleteFramebuffers(1, &gHiZDepthFbo);
+    glDeleteTextures(1, &gHiZDepthTexture);
+    glDeleteTextures(1, &gHiZTexture);
+    glDeleteBuffers(1, &gHiZReadback);
+    gHiZDepthFbo = gHiZDepthTexture = gHiZTexture = gHiZReadback = 0;
+    gHiZLevels.clear();
 }
 
 
-// Renders
+// Frustum planes (normals pointing inwards, normalized) from the rows of a view-projection matrix;
+// works for both the perspective and the ortho projection
+void UExtractFrustumPlanes(const glm::mat4& viewProjection, glm::vec4* planes) {
+    glm::vec4 rows[4];
+    for (int row = 0; row < 4; ++row)
+        rows[row] = glm::vec4(viewProjection[0][row], viewProjection[1][row], viewProjection[2][row], viewProjection[3][row]);
 
-void UDrawLightSources() {
-    glUseProgram(gProgramId);
+    planes[0] = rows[3] + rows[0];  // left
+    planes[1] = rows[3] - rows[0];  // right
+    planes[2] = rows[3] + rows[1];  // bottom
+    planes[3] = rows[3] - rows[1];  // top
+    planes[4] = rows[3] + rows[2];  // near
+    planes[5] = rows[3] - rows[2];  // far
 
-    // Apply scale
-    glm::mat4 scale = glm::scale(glm::vec3(0.5, 0.5, 0.5));
-    // Apply Rotation
-    glm::mat4 rotation = glm::rotate(45.0f, glm::vec3(0.5f, 0.5f, 0.5f));
-    // Apply Translation
-    glm::mat4 translation = glm::translate(glm::vec3(0.1, 0.1, 0.1));
-    // Apply model matrix
-    glm::mat4 model = translation * rotation * scale;
+    for (int plane = 0; plane < 6; ++plane)
+        planes[plane] = planes[plane] * (1.0f / glm::length(glm::vec3(planes[plane])));
+}
 
-    // Updates the camera and selects shader
-    glm::mat4 view = gCamera.GetViewMatrix();
-    glm::mat4 projection; // Initialize projection
 
+// A sphere is visible unless it lies entirely behind one of the planes. Tests 8 (AVX2 builds) or 4 (SSE2)
+// spheres per step from the gCull* arrays; count must be a multiple of 8
+void UCullSpheres(const glm::vec4* planes, size_t count, uint8_t* visible) {
+    size_t i = 0;
+#if defined(USIMD_AVX2)
+    for (; i + 8 <= count; i += 8) {
+        __m256 x = _mm256_loadu_ps(&gCullX[i]);
+        __m256 y = _mm256_loadu_ps(&gCullY[i]);
+        __m256 z = _mm256_loadu_ps(&gCullZ[i]);
+        __m256 negativeRadius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(&gCullRadius[i]));
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int plane = 0; plane < 6; ++plane) {
+            __m256 distance = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, _mm256_set1_ps(planes[plane].x)),
+                _mm256_mul_ps(y, _mm256_set1_ps(planes[plane].y))),
+                _mm256_add_ps(_mm256_mul_ps(z, _mm256_set1_ps(planes[plane].z)), _mm256_set1_ps(planes[plane].w)));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, negativeRadius, _CMP_GE_OQ));
+        }
 
-    // Determine whether the projection is perspective or ortho.
-    if (gPerspectiveView) {
-        // Creates perspective projection
-        projection = glm::perspective(glm::radians(gCamera.Zoom), (GLfloat)WINDOW_WIDTH / (GLfloat)WINDOW_HEIGHT, 0.1f, 100.0f);
-    }
-    else {
-        // Creates ortho projection
-        projection = glm::ortho(-2.0f, 2.0f, -2.0f, 2.0f, 0.1f, 100.0f);
+        int mask = _mm256_movemask_ps(inside);
+        for (int lane = 0; lane < 8; ++lane)
+            visible[i + lane] = (uint8_t)((mask >> lane) & 1);
     }
-    // Update camera
-    updateCamera(model);
+#endif
+#if defined(USIMD_SSE2)
+    for (; i + 4 <= count; i += 4) {
+        __m128 x = _mm_loadu_ps(&gCullX[i]);
+        __m128 y = _mm_loadu_ps(&gCullY[i]);
+        __m128 z = _mm_loadu_ps(&gCullZ[i]);
+        __m128 negativeRadius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(&gCullRadius[i]));
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int plane = 0; plane < 6; ++plane) {
+            __m128 distance = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, _mm_set1_ps(planes[plane].x)),
+                _mm_mul_ps(y, _mm_set1_ps(planes[plane].y))),
+                _mm_add_ps(_mm_mul_ps(z, _mm_set1_ps(planes[plane].z)), _mm_set1_ps(planes[plane].w)));
+            inside = _mm_and_ps(inside, _mm_cmpge_ps(distance, negativeRadius));
+        }
 
-    // Scale the texture proportional to the object
-    glm::vec2 gUVScale(1.0f, 1.0f);
+        int mask = _mm_movemask_ps(inside);
+        for (int lane = 0; lane < 4; ++lane)
+            visible[i + lane] = (uint8_t)((mask >> lane) & 1);
+    }
+#endif
+    for (; i < count; ++i) {
+        bool inside = true;
+        for (int plane = 0; plane < 6; ++plane)
+            inside = inside && planes[plane].x * gCullX[i] + planes[plane].y * gCullY[i] + planes[plane].z * gCullZ[i]
+                + planes[plane].w >= -gCullRadius[i];
+        visible[i] = inside ? 1 : 0;
+    }
+}
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(lMesh.vao);
+// LSD radix sort of the queue keys, one byte per pass; passes where every key has the same byte are skipped
+void USortRenderQueue() {
+    const size_t count = gRenderQueue.size();
+    gSortEntries.resize(count);
+    gSortScratch.resize(count);
 
-    // Draw the light source
-    GLint modelLoc;
-    GLint viewLoc;
-    GLint projLoc;
+    for (size_t i = 0; i < count; ++i) {
+        gSortEntries[i].key = gRenderQueue[i].key;
+        gSortEntries[i].packet = (uint32_t)i;
+    }
 
-    // Select shader program
-    glUseProgram(gLightProgramId);
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t histogram[256] = { 0 };
+        for (size_t i = 0; i < count; ++i)
+            ++histogram[(gSortEntries[i].key >> shift) & 0xFF];
 
-    model = glm::translate(sideLightPosition) * glm::scale(gLightScale);
+        if (histogram[(gSortEntries[0].key >> shift) & 0xFF] == count)
+            continue;
 
-    // Reference matrix uniforms from the Light Shader program
-    modelLoc = glGetUniformLocation(gLightProgramId, "model");
-    viewLoc = glGetUniformLocation(gLightProgramId, "view");
-    projLoc = glGetUniformLocation(gLightProgramId, "projection");
+        size_t offset = 0;
+        for (int bucket = 0; bucket < 256; ++bucket) {
+            size_t bucketCount = histogram[bucket];
+            histogram[bucket] = offset;
+            offset += bucketCount;
+        }
 
-    // Pass matrix data to the Light Shader program's matrix uniforms
-    glUniformMatrix4fv(modelLoc, 1, GL_FALSE, glm::value_ptr(model));
-    glUniformMatrix4fv(viewLoc, 1, GL_FALSE, glm::value_ptr(view));
-    glUniformMatrix4fv(projLoc, 1, GL_FALSE, glm::value_ptr(projection));
+        for (size_t i = 0; i < count; ++i)
+            gSortScratch[histogram[(gSortEntries[i].key >> shift) & 0xFF]++] = gSortEntries[i];
 
-    glDrawArrays(GL_TRIANGLES, 0, lMesh.nVertices);
-};
+        gSortEntries.swap(gSortScratch);
+    }
+}
 
-void drawPlane(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle) {
-    glUseProgram(gProgramId); 
 
-    // Apply scale
-    glm::mat4 scale = glm::scale(glm::vec3(xScale, yScale, zScale));
-    // Apply Rotation
-    glm::mat4 rotation = glm::rotate(angle, glm::vec3(1.0f, 1.0f, 1.0f));
-    // Apply Translation
-    glm::mat4 translation = glm::translate(glm::vec3(xPos, yPos, zPos));
-    // Apply model matrix
-    glm::mat4 model = translation * rotation * scale;
+// Sort the queue, then draw each run of identical program and texture array with one multi-draw indirect call
+void UExecuteRenderQueue(bool cameraPass) {
+    // Only the camera pass is timed; the shadow pass runs inside the UUpdateShadowMaps stage and stages cannot nest
+    if (cameraPass)
+        UBeginStage("renderQueueBuild");
 
-    // Update camera transformation
-    updateCamera(model);
+    if (cameraPass && (gFrustumCulling || gOcclusionCulling))
+        UCullRenderQueue();
+    gDrawnCount = gRenderQueue.size();
 
-    // Scale the texture proportional to the object
-    glm::vec2 gUVScale(1.0f, 1.0f);
+    if (gRenderQueue.empty()) {
+        if (cameraPass)
+            UEndStage();
+        return;
+    }
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+    USortRenderQueue();
+
+    const size_t count = gSortEntries.size();
+    gSortedInstances.resize(count);
+    for (size_t i = 0; i < count; ++i)
+        gSortedInstances[i] = gRenderQueue[gSortEntries[i].packet].instance;
+
+    // One indirect command per run of the same mesh and material; consecutive commands sharing program and
+    // texture array form a batch
+    gIndirectCommands.clear();
+    gDrawData.clear();
+    gMultiDrawBatches.clear();
+
+    size_t runStart = 0;
+    while (runStart < count) {
+        const RenderPacket& first = gRenderQueue[gSortEntries[runStart].packet];
+
+        size_t runEnd = runStart + 1;
+        while (runEnd < count && gRenderQueue[gSortEntries[runEnd].packet].mesh == first.mesh
+            && gRenderQueue[gSortEntries[runEnd].packet].program == first.program
+            && gRenderQueue[gSortEntries[runEnd].packet].material == first.material)
+            ++runEnd;
+
+        DrawElementsIndirectCommand command;
+        command.count = first.mesh->nIndices;
+        command.instanceCount = (GLuint)(runEnd - runStart);
+        command.firstIndex = first.mesh->firstIndex;
+        command.baseVertex = first.mesh->baseVertex;
+        command.baseInstance = (GLuint)runStart;
+
+        Material placement = (first.material == NO_MATERIAL) ? Material{ 0, 0, 0 } : gMaterials[first.material];
+
+        // The light program samples nothing, so it never needs to split a batch over texture arrays
+        if (gMultiDrawBatches.empty() || gMultiDrawBatches.back().program != first.program
+            || (placement.textureArray != 0 && gMultiDrawBatches.back().textureArray != placement.textureArray)) {
+            MultiDrawBatch batch = { first.program, placement.textureArray, (GLuint)gIndirectCommands.size(), 0 };
+            gMultiDrawBatches.push_back(batch);
+        }
+        ++gMultiDrawBatches.back().commandCount;
 
-    glBindVertexArray(planeMesh.vao);
+        DrawData draw = { (GLuint)runStart, placement.layer };
+        gIndirectCommands.push_back(command);
+        gDrawData.push_back(draw);
+        runStart = runEnd;
+    }
 
-    // Bind textures on corresponding texture units
+    // Orphan last frame's storage so the uploads do not wait for draws still reading it
+    while (gInstanceCapacity < count)
+        gInstanceCapacity *= 2;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gInstanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gInstanceCapacity * sizeof(InstanceData), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, count * sizeof(InstanceData), gSortedInstances.data());
+
+    while (gCommandCapacity < gIndirectCommands.size())
+        gCommandCapacity *= 2;
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gDrawBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gCommandCapacity * sizeof(DrawData), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, gDrawData.size() * sizeof(DrawData), gDrawData.data());
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, gIndirectBuffer);
+    glBufferData(GL_DRAW_INDIRECT_BUFFER, gCommandCapacity * sizeof(DrawElementsIndirectCommand), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, gIndirectCommands.size() * sizeof(DrawElementsIndirectCommand), gIndirectCommands.data());
+
+    // Every mesh lives in the arena, so the VAO is bound once for the whole scene
+    glBindVertexArray(gMeshArena.vao);
     glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, woodFloorTexture);
-
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, planeMesh.nVertices);
-}
 
-void drawPages(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle) {
-    glUseProgram(gProgramId); // Shader to be used
+    if (cameraPass)
+        UEndStage();
+
+    if (cameraPass && gDepthPrepass) {
+        // Lay down the nearest depth with the position-only program, then shade only the fragments matching it
+        UBeginStage("depthPrepass");
+        glColorMask(GL_FALSE, GL_FALSE, GL_FALSE, GL_FALSE);
+        UDrawBatches(UReadyProgram(gDepthProgramId));
+        glColorMask(GL_TRUE, GL_TRUE, GL_TRUE, GL_TRUE);
+        glDepthFunc(GL_EQUAL);
+        glDepthMask(GL_FALSE);
+        UEndStage();
+    }
 
-    // Apply scale
-    glm::mat4 scale = glm::scale(glm::vec3(xScale, yScale, zScale));
-    // Apply Rotation
-    glm::mat4 rotation = glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f));
-    // Apply Translation
-    glm::mat4 translation = glm::translate(glm::vec3(xPos, yPos, zPos));
-    // Apply model matrix
-    glm::mat4 model = translation * rotation * scale;
+    if (cameraPass && gOverdrawView) {
+        // Count instead of shading: each fragment that passes the depth test adds one step of brightness
+        UBeginStage("overdraw");
+        glEnable(GL_BLEND);
+        glBlendFunc(GL_ONE, GL_ONE);
+        glBeginQuery(GL_SAMPLES_PASSED, gOverdrawQuery);
+        UDrawBatches(UReadyProgram(gOverdrawProgramId));
+        glEndQuery(GL_SAMPLES_PASSED);
+        gOverdrawQueryIssued = true;
+        glDisable(GL_BLEND);
+        UEndStage();
+    }
+    else {
+        if (cameraPass)
+            UBeginStage(gDeferred ? "gBufferFill" : "shading");
+        UDrawBatches(0);
+        if (cameraPass)
+            UEndStage();
+    }
 
-    // Updates the camera and selects shader
-    glm::mat4 view = gCamera.GetViewMatrix();
-    glm::mat4 projection; // Initialize projection
+    if (cameraPass && gDepthPrepass) {
+        glDepthFunc(GL_LESS);
+        glDepthMask(GL_TRUE);
+    }
 
-    // Update camera
-    updateCamera(model);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    gRenderQueue.clear();
+}
 
-    // Scale the texture proportional to the object
-    glm::vec2 gUVScale(1.0f, 0.1f);
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+// Issue the uploaded multi-draw batches; a non-zero override draws them all with that program and no textures
+void UDrawBatches(GLuint programOverride) {
+    GLuint boundProgram = 0;
+    GLuint boundTextureArray = 0;
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(pagesMesh.vao);
+    for (const MultiDrawBatch& batch : gMultiDrawBatches) {
+        const GLuint program = programOverride ? programOverride : batch.program;
+        if (program != boundProgram) {
+            glUseProgram(program);
+            glUniform3f(UUniform(program, UNIFORM_OBJECT_COLOR), gObjectColor.r, gObjectColor.g, gObjectColor.b);
+            boundProgram = program;
+        }
+        if (!programOverride && batch.textureArray != 0 && batch.textureArray != boundTextureArray) {
+            glBindTexture(GL_TEXTURE_2D_ARRAY, batch.textureArray);
+            boundTextureArray = batch.textureArray;
+        }
 
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bookPagesTexture);
+        const GLint drawIdBaseLoc = UUniform(program, UNIFORM_DRAW_ID_BASE);
+        const size_t commandOffset = batch.firstCommand * sizeof(DrawElementsIndirectCommand);
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, pagesMesh.nVertices);
+        if (gHasDrawParameters) {
+            // gl_DrawIDARB counts from 0 within this call
+            glUniform1ui(drawIdBaseLoc, batch.firstCommand);
+            glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)commandOffset, batch.commandCount, 0);
+        }
+        else {
+            // DRAW_ID is 0 in the shader, so point drawIdBase at each command in turn
+            for (GLuint command = 0; command < batch.commandCount; ++command) {
+                glUniform1ui(drawIdBaseLoc, batch.firstCommand + command);
+                glDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(commandOffset + command * sizeof(DrawElementsIndirectCommand)));
+            }
+        }
+    }
 }
 
 
-void drawCover(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle) {
-    glUseProgram(gProgramId); // Shader to be used
+// Per-frame instance, per-draw and indirect command buffers
+void UCreateDrawBuffers() {
+    gInstanceCapacity = 64;
+    gCommandCapacity = 16;
+
+    glGenBuffers(1, &gInstanceBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gInstanceBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gInstanceCapacity * sizeof(InstanceData), NULL, GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, INSTANCE_SSBO_BINDING, gInstanceBuffer);
 
-    // Apply scale
-    glm::mat4 scale = glm::scale(glm::vec3(xScale, yScale, zScale));
-    // Apply Rotation
-    glm::mat4 rotation = glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f));
-    // Apply Translation
-    glm::mat4 translation = glm::translate(glm::vec3(xPos, yPos, zPos));
-    // Apply model matrix
-    glm::mat4 model = translation * rotation * scale;
+    glGenBuffers(1, &gDrawBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, gDrawBuffer);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, gCommandCapacity * sizeof(DrawData), NULL, GL_STREAM_DRAW);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, DRAW_SSBO_BINDING, gDrawBuffer);
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
 
-    // Updates the camera and selects shader
-    updateCamera(model);
+    glGenBuffers(1, &gIndirectBuffer);
+}
 
-    // Scale the texture proportional to the object
-    glm::vec2 gUVScale(1.0f, 1.0f);
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+void UDestroyDrawBuffers() {
+    glDeleteBuffers(1, &gInstanceBuffer);
+    glDeleteBuffers(1, &gDrawBuffer);
+    glDeleteBuffers(1, &gIndirectBuffer);
+}
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(bookCoverMesh.vao);
 
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, bookCoverTexture);
+// Insert the DRAW_ID definition after the #version line: gl_DrawIDARB when supported, otherwise 0. Applied last,
+// so the #extension line stays ahead of any spliced-in declarations
+std::string UAddDrawParameters(const std::string& shaderSource) {
+    std::string source(shaderSource);
+    const char* header = gHasDrawParameters
+        ? "#extension GL_ARB_shader_draw_parameters : require\n#define DRAW_ID uint(gl_DrawIDARB)\n"
+        : "#define DRAW_ID 0u\n";
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, bookCoverMesh.nVertices);
+    return UAddDefines(source, header);
 }
 
+// FrameData block and the instance and draw buffers, declared once for every vertex shader that reads the queue
+std::string UAddInstanceInterface(const std::string& shaderSource) {
+    return UAddDefines(UAddDefines(shaderSource, instanceDataSource), frameDataSource);
+}
 
-void drawWandbox(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle) {
-    glUseProgram(gProgramId); // Shader to be used
+// Insert preprocessor lines (or shared GLSL_SHARED snippets) right after the #version line
+std::string UAddDefines(const std::string& shaderSource, const char* defines) {
+    std::string source(shaderSource);
+    source.insert(source.find('\n') + 1, defines);
+    return source;
+}
 
-    // Apply scale
-    glm::mat4 scale = glm::scale(glm::vec3(xScale, yScale, zScale));
-    // Apply Rotation
-    glm::mat4 rotation = glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f));
-    // Apply Translation
-    glm::mat4 translation = glm::translate(glm::vec3(xPos, yPos, zPos));
-    // Apply model matrix
-    glm::mat4 model = translation * rotation * scale;
 
-    // Update the camera's position
-    updateCamera(model);
+// Transforms
 
-    // Scale the texture proportional to the object
-    glm::vec2 gUVScale(1.0f, 1.0f);
+// Add an entry to the transform store; the parent must already exist
+int UCreateTransform(const glm::vec3& position, const glm::vec3& rotationAxis, float rotationAngle, const glm::vec3& scale, int parent) {
+    TransformStore& store = gTransforms;
+    const int transform = (int)store.position.size();
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+    store.position.push_back(position);
+    store.rotationAxis.push_back(rotationAxis);
+    store.rotationAngle.push_back(rotationAngle);
+    store.scale.push_back(scale);
+    store.parent.push_back(parent);
+    store.world.push_back(glm::mat4(1.0f));
+    store.normalMatrix.push_back(glm::mat3(1.0f));
+    store.dirty.push_back(0);
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(wandBoxMesh.vao);
+    UMarkTransformDirty(transform);
+    return transform;
+}
 
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, greenLeatherTexture);
+void UMarkTransformDirty(int transform) {
+    if (!gTransforms.dirty[transform]) {
+        gTransforms.dirty[transform] = 1;
+        ++gTransforms.dirtyCount;
+    }
+}
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, wandBoxMesh.nVertices);
+void USetTransformPosition(int transform, const glm::vec3& position) {
+    gTransforms.position[transform] = position;
+    UMarkTransformDirty(transform);
 }
 
-void drawMug(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle) {
-    glUseProgram(gProgramId);
+void USetTransformRotation(int transform, const glm::vec3& axis, float angle) {
+    gTransforms.rotationAxis[transform] = axis;
+    gTransforms.rotationAngle[transform] = angle;
+    UMarkTransformDirty(transform);
+}
 
-    // Apply scale
-    glm::mat4 scale = glm::scale(glm::vec3(xScale, yScale, zScale));
-    // Apply Rotation
-    glm::mat4 rotation = glm::rotate(angle, glm::vec3(0.0f, 1.0f, 0.0f));
-    // Apply Translation
-    glm::mat4 translation = glm::translate(glm::vec3(xPos, yPos, zPos));
-    // Apply model matrix
-    glm::mat4 model = translation * rotation * scale;
+void USetTransformScale(int transform, const glm::vec3& scale) {
+    gTransforms.scale[transform] = scale;
+    UMarkTransformDirty(transform);
+}
 
-    // Updates the camera and selects shader
-    updateCamera(model);
+// Recompute world and normal matrices of dirty entries in index order, so a parent is always current before
+// its children; a child of a rebuilt parent is rebuilt too
+void UUpdateTransforms() {
+    TransformStore& store = gTransforms;
+    gTransformsRebuilt = 0;
+    gRebuiltTransforms.clear();
+    if (store.dirtyCount == 0)
+        return;
+
+    const size_t count = store.position.size();
+    for (size_t i = 0; i < count; ++i) {
+        const int parent = store.parent[i];
+        if (!store.dirty[i] && !(parent >= 0 && store.dirty[parent]))
+            continue;
+        store.dirty[i] = 1;
+
+        glm::mat4 local = glm::translate(store.position[i])
+                        * glm::rotate(store.rotationAngle[i], store.rotationAxis[i])
+                        * glm::scale(store.scale[i]);
+        store.world[i] = (parent >= 0) ? store.world[parent] * local : local;
+        store.normalMatrix[i] = glm::transpose(glm::inverse(glm::mat3(store.world[i])));
+        gRebuiltTransforms.push_back((int)i);
+        ++gTransformsRebuilt;
+    }
 
-    // Scale the texture proportional to the object
-    glm::vec2 gUVScale(1.0f, 1.0f);
+    std::fill(store.dirty.begin(), store.dirty.end(), (uint8_t)0);
+    store.dirtyCount = 0;
+}
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+// Desk layout
+void UCreateSceneTransforms() {
+    const glm::vec3 up(0.0f, 1.0f, 0.0f);
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(mugMesh.vao);
+    gLightTransform = UCreateTransform(sideLightPosition, up, 0.0f, gLightScale, -1);
+    gPlaneTransform = UCreateTransform(glm::vec3(0.0f, -0.01f, 0.0f), glm::vec3(1.0f, 1.0f, 1.0f), 0.0f, glm::vec3(5.0f, 1.0f, 5.0f), -1);
+    gWandboxTransform = UCreateTransform(glm::vec3(0.0f), up, 5.0f, glm::vec3(0.75f, 1.0f, 3.0f), -1);
+    gCoverTransform = UCreateTransform(glm::vec3(-2.5f, 0.0f, -2.0f), up, 14.0f, glm::vec3(1.0f, 1.015f, 1.02f), -1);
+    gPagesTransform = UCreateTransform(glm::vec3(-2.5f, 0.02f, -2.0f), up, 14.0f, glm::vec3(0.5f, 3.0f, 1.0f), -1);
 
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, mugTexture);
+    // Shaft, grip and pommel share the wand's placement and differ only in scale
+    gWandTransform = UCreateTransform(glm::vec3(2.0f, 0.07f, 3.0f), glm::vec3(0.3f, -1.3f, 1.2f), 15.0f, glm::vec3(1.0f), -1);
+    gWandPartTransforms[0] = UCreateTransform(glm::vec3(0.0f), up, 0.0f, glm::vec3(0.05f, 4.0f, 0.05f), gWandTransform);
+    gWandPartTransforms[1] = UCreateTransform(glm::vec3(0.0f), up, 0.0f, glm::vec3(0.07f, 1.0f, 0.07f), gWandTransform);
+    gWandPartTransforms[2] = UCreateTransform(glm::vec3(0.0f), up, 0.0f, glm::vec3(0.09f, 0.02f, 0.09f), gWandTransform);
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, mugMesh.nVertices);
+    gMugTransform = UCreateTransform(glm::vec3(0.25f, 0.0f, -2.0f), up, 0.0f, glm::vec3(0.35f, 1.0f, 0.35f), -1);
 }
 
-void drawWand(float xScale, float yScale, float zScale, float xPos, float yPos, float zPos, float angle) {
-    glUseProgram(gProgramId);
 
-    // Apply scale
-    glm::mat4 scale = glm::scale(glm::vec3(xScale, yScale, zScale));
-    // Apply Rotation
-    glm::mat4 rotation = glm::rotate(angle, glm::vec3(0.3f, -1.3f, 1.2f));
-    // Apply Translation
-    glm::mat4 translation = glm::translate(glm::vec3(xPos, yPos, zPos));
-    // Apply model matrix
-    glm::mat4 model = translation * rotation * scale;
+// Renders
 
-    // Updates the camera and selects shader
-    updateCamera(model);
+// Function to draw all the shapes
+void URender() {
+    UBeginTimingFrame();
 
-    // Scale the texture proportional to the object
-    glm::vec2 gUVScale(1.0f, 1.0f);
+    // Switch any programs that finished linking since last frame over from the fallback
+    UResolveShaderPrograms();
 
-    GLint UVScaleLoc = glGetUniformLocation(gProgramId, "uvScale");
-    glUniform2fv(UVScaleLoc, 1, glm::value_ptr(gUVScale));
+    // Window framebuffer, or the offscreen target when headless
+    glBindFramebuffer(GL_FRAMEBUFFER, gOffscreenFbo);
 
-    // Activate the VBOs contained within the mesh's VAO
-    glBindVertexArray(cylinderMesh.vao);
+    // Camera, projection and lights for every draw this frame
+    UUpdateFrameUniforms();
 
-    // Bind textures on corresponding texture units
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, wandWoodTexture);
+    // Rebuild the world matrices of anything that moved; a static scene skips this entirely
+    UAnimateScene();
+    UUpdateTransforms();
+    USyncSceneTransforms();
 
-    // Draws the triangles
-    glDrawArrays(GL_TRIANGLES, 0, cylinderMesh.nVertices);
-}
+    // Flicker the lights and sort them into this frame's view clusters
+    UBeginStage("UUpdateLights");
+    UUpdateLights();
+    UEndStage();
 
-// Function to draw all the shapes
-void URender() {
+    // Re-render the cached static shadow map if needed, then add whatever moves
+    if (gShadows) {
+        UBeginStage("UUpdateShadowMaps");
+        UUpdateShadowMaps();
+        UEndStage();
+    }
+
+    // Pick up last frame's Hi-Z readback if the GPU has finished it
+    if (gOcclusionCulling)
+        UResolveHiZReadback();
     glEnable(GL_DEPTH_TEST);
 
     // Clear the frame and z buffers
-    glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
+    UBeginStage("clear");
+    if (gOverdrawView)
+        glClearColor(0.0f, 0.0f, 0.0f, 1.0f); // Black where nothing is drawn
+    else
+        glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    // Light
-    UDrawLightSources();
+    // The deferred geometry pass draws into the G-buffer; the frame keeps its clear color for the background
+    if (gDeferred) {
+        glBindFramebuffer(GL_FRAMEBUFFER, gGBufferFbo);
+        glClearColor(0.0f, 0.0f, 0.0f, 0.0f);
+        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    }
+    UEndStage();
+
+    // The draw functions only queue packets, so this stage is CPU time; its GPU column stays near zero
+    UBeginStage("queueDraws");
 
-    // Floor
-    drawPlane(5.0, 1.0, 5.0, 0.0, -0.01, 0.0, 0.0);
+    // Desk objects, lamps and props the scene BVH finds in the view frustum
+    UDrawSceneObjects();
 
-    // Wandbox
-    drawWandbox(.75, 1.0, 3.0, 0.0, 0.0, 0.0, 5.0);
+    UEndStage();
 
-    // Book
-    drawCover(1.0, 1.015, 1.02, -2.5, 0.0, -2.0, 14.0); 
-    drawPages(0.5, 3.0, 1.0, -2.5, 0.02, -2.0, 14.0); 
+    // Sort the packets and issue the draws; times its own build, depth and shading stages
+    UExecuteRenderQueue(true);
 
-    // Wand
-    drawWand(0.05, 4.0, 0.05, 2.0, 0.07, 3.0, 15.0);
-    drawWand(0.07, 1.0, 0.07, 2.0, 0.07, 3.0, 15.0);
-    drawWand(0.09, 0.02, 0.09, 2.0, 0.07, 3.0, 15.0);
+    // Light the G-buffer into the frame
+    if (gDeferred) {
+        UBeginStage("UDeferredLighting");
+        UDeferredLighting();
+        UEndStage();
+    }
 
-    //Mug
-    drawMug(0.35, 1.0, 0.35, 0.25, 0.0, -2.0, 0.0);
+    // Reduce this frame's depth for next frame's occlusion test
+    if (gOcclusionCulling) {
+        UBeginStage("UBuildHiZ");
+        UBuildHiZ();
+        UEndStage();
+    }
 
     // Deactviate VAO
     glBindVertexArray(0);
     glUseProgram(0);
 
-    // Refresh the screen
-    glfwSwapBuffers(gWindow);
+    UEndTimingFrame();
 }
 
 // Meshes
 
 // Template for creating a cube light
-void UCreateLightMesh(GLMesh& mesh)
+void UCreateLightMesh(GLDoubleMesh& mesh)
 {
     // Vertex Data
     GLfloat verts[] = {
@@ -889,850 +4125,1313 @@ void UCreateLightMesh(GLMesh& mesh)
        0.5f,  1.0f,  0.5f,    0.0f,  0.0f, -1.0f,  1.0f, 1.0f,
     };
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    UCreateIndexedMesh(verts, sizeof(verts) / sizeof(verts[0]), mesh);
+}
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+void createPlaneMesh(GLDoubleMesh& mesh) {
+    GLfloat verts[] = {
+       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
+        1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,
+        1.0f,  0.0f, -1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 1.0f,
+       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,
+       -1.0f,  0.0f, -1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
+        1.0f,  0.0f, -1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f
+    };
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    UCreateIndexedMesh(verts, sizeof(verts) / sizeof(verts[0]), mesh);
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
 
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+void createWandboxMesh(GLDoubleMesh& mesh) {
+    // Unit footprint, half as tall, sitting on y = 0
+    std::vector<GLfloat> verts;
+    UGenerateBox(1.0f, 0.5f, 1.0f, verts);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    UCreateIndexedMesh(verts.data(), verts.size(), mesh);
+}
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+void createPagesMesh(GLDoubleMesh& mesh) {
+    GLfloat verts[] = {
+        // bottom of pages
+       -1.0f,  0.0f, -1.0f,   0.0f, -1.0f, 0.0f,    0.0f, 1.0f,    
+       -1.0f,  0.0f,  1.0f,   0.0f, -1.0f, 0.0f,    0.0f, 0.0f,   
+        1.0f,  0.0f, -1.0f,   0.0f, -1.0f, 0.0f,    1.0f, 1.0f,   
+       -1.0f,  0.0f,  1.0f,   0.0f, -1.0f, 0.0f,    0.0f, 0.0f,
+        1.0f,  0.0f, -1.0f,   0.0f, -1.0f, 0.0f,    1.0f, 1.0f,
+        1.0f,  0.0f,  1.0f,   0.0f, -1.0f, 0.0f,    1.0f, 0.0f,
+
+        // front of pages
+       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
+       -1.0f,  1.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 1.0f,
+        1.0f,  1.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,
+        1.0f,  1.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,
+        1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,
+       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
+
+        // top of pages
+       -1.0f,  1.0f, -1.0f,   0.0f,  1.0f, 0.0f,  0.0f, 0.25f,
+       -1.0f,  1.0f,  1.0f,   0.0f,  1.0f, 0.0f,  0.0f, 0.75f,
+        1.0f,  1.0f, -1.0f,   0.0f,  1.0f, 0.0f,  1.0f, 0.25f,
+        1.0f,  1.0f, -1.0f,   0.0f,  1.0f, 0.0f,  1.0f, 0.25f,
+       -1.0f,  1.0f,  1.0f,   0.0f,  1.0f, 0.0f,  0.0f, 0.75f,
+        1.0f,  1.0f,  1.0f,   0.0f,  1.0f, 0.0f,  1.0f, 0.75f
+    };
+
+    UCreateIndexedMesh(verts, sizeof(verts) / sizeof(verts[0]), mesh);
 }
 
-void createPlaneMesh(GLMesh& mesh) {
+void createBookCoverMesh(GLDoubleMesh& mesh) {
     GLfloat verts[] = {
-       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
-        1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,
-        1.0f,  0.0f, -1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 1.0f,
-       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,
-       -1.0f,  0.0f, -1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
-        1.0f,  0.0f, -1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f
+        // left side of book
+       -0.5f,  0.0f,  1.0f,   -1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
+       -0.5f,  0.0f, -1.0f,   -1.0f, 0.0f, 0.0f,   0.0f, 0.0f,   
+       -0.5f,  3.0f, -1.0f,   -1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
+       -0.5f,  3.0f, -1.0f,   -1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
+       -0.5f,  0.0f,  1.0f,   -1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
+       -0.5f,  3.0f,  1.0f,   -1.0f, 0.0f, 0.0f,   1.0f, 1.0f,    
+
+        // right side of book
+        0.5f,  0.0f,  1.0f,   1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
+        0.5f,  0.0f, -1.0f,   1.0f, 0.0f, 0.0f,   0.0f, 0.0f,    
+        0.5f,  3.0f, -1.0f,   1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
+        0.5f,  3.0f, -1.0f,   1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
+        0.5f,  0.0f,  1.0f,   1.0f, 0.0f, 0.0f,   1.0f, 0.0f,   
+        0.5f,  3.0f,  1.0f,   1.0f, 0.0f, 0.0f,   1.0f, 1.0f,  
+
+        // spine of book
+       -0.5f,  0.0f, -1.0f,   0.0f,  0.0f, -1.0f,  0.0f, 0.0f,    
+        0.5f,  3.0f, -1.0f,   0.0f,  0.0f, -1.0f,  1.0f, 1.0f, 
+       -0.5f,  3.0f, -1.0f,   0.0f,  0.0f, -1.0f,  0.0f, 1.0f,   
+       -0.5f,  0.0f, -1.0f,   0.0f,  0.0f, -1.0f,  0.0f, 0.0f,    
+        0.5f,  3.0f, -1.0f,   0.0f,  0.0f, -1.0f,  1.0f, 1.0f,    
+        0.5f,  0.0f, -1.0f,   0.0f,  0.0f, -1.0f,  1.0f, 0.0f,    
     };
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    UCreateIndexedMesh(verts, sizeof(verts) / sizeof(verts[0]), mesh);
+}
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+void createMugMesh(LodMesh& lods) {
+    // Open-topped cup that widens from radius 1 to 1.2, with a handle
+    CylinderParams params = { 0, 1.0f, 1.2f, 1.0f, true, false, true };
+    const int segmentCounts[MAX_LODS] = { 64, 32, 20, 10 };
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    UCreateLodChain(params, segmentCounts, MAX_LODS, lods);
+}
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+void createWandMesh(LodMesh& lods) {
+    // Closed unit cylinder, scaled per wand part when drawn
+    CylinderParams params = { 0, 1.0f, 1.0f, 1.0f, true, true, false };
+    const int segmentCounts[MAX_LODS] = { 32, 16, 8, 4 };
 
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+    UCreateLodChain(params, segmentCounts, MAX_LODS, lods);
+}
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+// Primitive generation
+
+// Append one interleaved vertex
+void UPushVertex(std::vector<GLfloat>& verts, const glm::vec3& position, const glm::vec3& normal, float u, float v) {
+    const GLfloat vertex[FLOATS_PER_VERTEX] = {
+        position.x, position.y, position.z, normal.x, normal.y, normal.z, u, v
+    };
+    verts.insert(verts.end(), vertex, vertex + FLOATS_PER_VERTEX);
+}
+
+// Triangle list for a (possibly tapered) cylinder around the y axis, base at y = 0
+void UGenerateCylinder(const CylinderParams& params, std::vector<GLfloat>& verts) {
+    const float twoPi = 6.28318530718f;
+    const int segments = params.segments;
+    const float rb = params.bottomRadius;
+    const float rt = params.topRadius;
+    const float h = params.height;
+
+    // The side normal tilts against the taper
+    const float slope = (rb - rt) / h;
+
+    for (int i = 0; i < segments; ++i) {
+        float a0 = twoPi * i / segments;
+        float a1 = twoPi * (i + 1) / segments;
+        glm::vec3 d0(cos(a0), 0.0f, sin(a0));
+        glm::vec3 d1(cos(a1), 0.0f, sin(a1));
+        glm::vec3 n0 = glm::normalize(glm::vec3(d0.x, slope, d0.z));
+        glm::vec3 n1 = glm::normalize(glm::vec3(d1.x, slope, d1.z));
+        float u0 = (float)i / segments;
+        float u1 = (float)(i + 1) / segments;
+
+        glm::vec3 b0 = d0 * rb;
+        glm::vec3 b1 = d1 * rb;
+        glm::vec3 t0 = d0 * rt + glm::vec3(0.0f, h, 0.0f);
+        glm::vec3 t1 = d1 * rt + glm::vec3(0.0f, h, 0.0f);
+
+        // Side
+        UPushVertex(verts, b0, n0, u0, 0.0f);
+        UPushVertex(verts, t1, n1, u1, 1.0f);
+        UPushVertex(verts, b1, n1, u1, 0.0f);
+        UPushVertex(verts, b0, n0, u0, 0.0f);
+        UPushVertex(verts, t0, n0, u0, 1.0f);
+        UPushVertex(verts, t1, n1, u1, 1.0f);
+
+        // Base
+        if (params.bottomCap) {
+            const glm::vec3 down(0.0f, -1.0f, 0.0f);
+            UPushVertex(verts, glm::vec3(0.0f), down, 0.5f, 0.5f);
+            UPushVertex(verts, b0, down, 0.5f + 0.5f * d0.x, 0.5f + 0.5f * d0.z);
+            UPushVertex(verts, b1, down, 0.5f + 0.5f * d1.x, 0.5f + 0.5f * d1.z);
+        }
+
+        // Top
+        if (params.topCap) {
+            const glm::vec3 up(0.0f, 1.0f, 0.0f);
+            UPushVertex(verts, glm::vec3(0.0f, h, 0.0f), up, 0.5f, 0.5f);
+            UPushVertex(verts, t1, up, 0.5f + 0.5f * d1.x, 0.5f + 0.5f * d1.z);
+            UPushVertex(verts, t0, up, 0.5f + 0.5f * d0.x, 0.5f + 0.5f * d0.z);
+        }
+    }
+
+    if (!params.handle)
+        return;
+
+    // Handle: a tube swept along a half ellipse that leaves and re-enters the wall on the +x side
+    const float pi = twoPi * 0.5f;
+    const int pathSegments = max(3, segments / 2);
+    const int tubeSegments = max(3, segments / 4);
+    const float centerY = 0.55f * h;
+    const float reachX = 0.7f * max(rb, rt);
+    const float halfSpanY = 0.3f * h;
+    const float thickness = 0.08f * h;
+
+    auto ringPoint = [&](int step, int around, glm::vec3& position, glm::vec3& normal) {
+        float t = pi * step / pathSegments;
+        float phi = twoPi * around / tubeSegments;
+        float y = centerY + halfSpanY * cos(t);
+        float wall = rb + (rt - rb) * (y / h);
+        glm::vec3 center(wall + reachX * sin(t), y, 0.0f);
+        glm::vec3 tangent = glm::normalize(glm::vec3(reachX * cos(t), -halfSpanY * sin(t), 0.0f));
+        glm::vec3 outward(tangent.y, -tangent.x, 0.0f);
+        normal = outward * cos(phi) + glm::vec3(0.0f, 0.0f, 1.0f) * sin(phi);
+        position = center + normal * thickness;
+    };
+
+    for (int step = 0; step < pathSegments; ++step) {
+        for (int around = 0; around < tubeSegments; ++around) {
+            glm::vec3 p00, p01, p10, p11, n00, n01, n10, n11;
+            ringPoint(step, around, p00, n00);
+            ringPoint(step, around + 1, p01, n01);
+            ringPoint(step + 1, around, p10, n10);
+            ringPoint(step + 1, around + 1, p11, n11);
+
+            float u0 = (float)step / pathSegments;
+            float u1 = (float)(step + 1) / pathSegments;
+            float v0 = (float)around / tubeSegments;
+            float v1 = (float)(around + 1) / tubeSegments;
+
+            UPushVertex(verts, p00, n00, u0, v0);
+            UPushVertex(verts, p10, n10, u1, v0);
+            UPushVertex(verts, p11, n11, u1, v1);
+            UPushVertex(verts, p00, n00, u0, v0);
+            UPushVertex(verts, p11, n11, u1, v1);
+            UPushVertex(verts, p01, n01, u0, v1);
+        }
+    }
+}
+
+// Triangle list for a box centered on the y axis with its base at y = 0
+void UGenerateBox(float width, float height, float depth, std::vector<GLfloat>& verts) {
+    const float x = width * 0.5f;
+    const float z = depth * 0.5f;
+
+    // Each face: normal plus the corner the (0,0) texture coordinate sits at and its two edges
+    struct Face { glm::vec3 normal, origin, uEdge, vEdge; };
+    const Face faces[6] = {
+        { glm::vec3(0.0f, -1.0f, 0.0f), glm::vec3(-x, 0.0f, -z),     glm::vec3(width, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, depth) },   // bottom
+        { glm::vec3(0.0f, 1.0f, 0.0f),  glm::vec3(-x, height, z),    glm::vec3(width, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, -depth) },  // top
+        { glm::vec3(0.0f, 0.0f, 1.0f),  glm::vec3(-x, 0.0f, z),      glm::vec3(width, 0.0f, 0.0f), glm::vec3(0.0f, height, 0.0f) },  // front
+        { glm::vec3(0.0f, 0.0f, -1.0f), glm::vec3(x, 0.0f, -z),      glm::vec3(-width, 0.0f, 0.0f), glm::vec3(0.0f, height, 0.0f) }, // back
+        { glm::vec3(-1.0f, 0.0f, 0.0f), glm::vec3(-x, 0.0f, -z),     glm::vec3(0.0f, 0.0f, depth), glm::vec3(0.0f, height, 0.0f) },  // left side
+        { glm::vec3(1.0f, 0.0f, 0.0f),  glm::vec3(x, 0.0f, z),       glm::vec3(0.0f, 0.0f, -depth), glm::vec3(0.0f, height, 0.0f) }, // right side
+    };
+
+    for (const Face& face : faces) {
+        glm::vec3 p00 = face.origin;
+        glm::vec3 p10 = face.origin + face.uEdge;
+        glm::vec3 p11 = face.origin + face.uEdge + face.vEdge;
+        glm::vec3 p01 = face.origin + face.vEdge;
+
+        UPushVertex(verts, p00, face.normal, 0.0f, 0.0f);
+        UPushVertex(verts, p10, face.normal, 1.0f, 0.0f);
+        UPushVertex(verts, p11, face.normal, 1.0f, 1.0f);
+        UPushVertex(verts, p00, face.normal, 0.0f, 0.0f);
+        UPushVertex(verts, p11, face.normal, 1.0f, 1.0f);
+        UPushVertex(verts, p01, face.normal, 0.0f, 1.0f);
+    }
+}
+
+// Generate the same cylinder at each segment count, finest first
+void UCreateLodChain(CylinderParams params, const int* segmentCounts, int levelCount, LodMesh& lods) {
+    lods.levelCount = min(levelCount, MAX_LODS);
+    lods.radius = max(params.bottomRadius, params.topRadius);
+    lods.height = params.height;
+
+    std::vector<GLfloat> verts;
+    for (int level = 0; level < lods.levelCount; ++level) {
+        params.segments = segmentCounts[level];
+
+        verts.clear();
+        UGenerateCylinder(params, verts);
+        UCreateIndexedMesh(verts.data(), verts.size(), lods.levels[level]);
+    }
+}
+
+// Choose the coarsest level that still keeps the silhouette smooth at the object's projected size
+const GLDoubleMesh& USelectLod(const LodMesh& lods, const glm::mat4& model) {
+    // Tessellation only changes the outline around the axis, so size the object by its radial extent
+    float radialScale = max(glm::length(glm::vec3(model[0])), glm::length(glm::vec3(model[2])));
+    float worldRadius = lods.radius * radialScale;
+    glm::vec3 center = glm::vec3(model * glm::vec4(0.0f, lods.height * 0.5f, 0.0f, 1.0f));
+
+    float projectedDiameter;
+    if (gPerspectiveView) {
+        float distance = max(glm::length(center - gCamera.Position), 0.1f);
+        float halfFov = glm::radians(gCamera.Zoom) * 0.5f;
+        projectedDiameter = worldRadius / (distance * tan(halfFov)) * WINDOW_HEIGHT;
+    }
+    else {
+        // Matches the 4 unit tall view volume of UProjectionMatrix()
+        projectedDiameter = worldRadius * 2.0f / 4.0f * WINDOW_HEIGHT;
+    }
+
+    for (int level = 0; level < lods.levelCount - 1; ++level) {
+        if (projectedDiameter >= LOD_SCREEN_THRESHOLDS[level])
+            return lods.levels[level];
+    }
+    return lods.levels[lods.levelCount - 1];
+}
+
+void UDestroyLodMesh(LodMesh& lods) {
+    for (int level = 0; level < lods.levelCount; ++level)
+        UDestroyMesh(lods.levels[level]);
+}
+
+
+/*Register a texture as a material; only the header is read here, decoding and upload happen in UBuildTextureArrays*/
+bool ULoadMaterial(const char* filename, GLuint& materialId)
+{
+    int width, height, channels;
+    if (!stbi_info(filename, &width, &height, &channels))
+        return false; // Missing file or unsupported format
+
+    materialId = (GLuint)gMaterials.size();
+    gMaterials.push_back(Material{ 0, 0, 0 });
+
+    // Opaque images compress to BC1, images with alpha to BC3; every mip level is stored precompressed
+    TextureJob job = { filename, materialId, width, height, GL_RGBA8, 0, 0, false, false };
+    if (gHasS3tc)
+        job.format = (channels == 2 || channels == 4) ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+
+    for (GLsizei level = 0; level < UTextureLevelCount(width, height); ++level)
+        job.stagingBytes += UTextureLevelBytes(job.format, max(1, width >> level), max(1, height >> level));
+
+    gTextureJobs.push_back(job);
+
+    return true;
+}
+
+// Decode pool worker: decode the next unclaimed texture straight into its slot of the staging PBO
+void UDecodeTextureWorker()
+{
+    for (size_t index = gNextTextureJob++; index < gTextureJobs.size(); index = gNextTextureJob++)
+    {
+        TextureJob& job = gTextureJobs[index];
+        unsigned char* destination = gTextureStaging + job.stagingOffset;
+
+        std::ifstream file(job.filename, std::ios::binary);
+        std::vector<unsigned char> source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+        // FNV-1a over the source bytes keys the compressed cache
+        uint64_t sourceHash = 14695981039346656037ull;
+        for (unsigned char byte : source)
+            sourceHash = (sourceHash ^ byte) * 1099511628211ull;
+
+        if (job.format != GL_RGBA8 && UReadTextureCache(job, sourceHash, destination))
+        {
+            job.decoded = true;
+            job.cached = true;
+        }
+        else
+        {
+            // Every layer of a texture array shares one format. RGB is decoded as is and expanded by the SIMD
+            // kernel below; grey and grey-alpha images are rare enough to let stb_image expand them
+            int width, height, channels;
+            stbi_info_from_memory(source.data(), (int)source.size(), &width, &height, &channels);
+            const int desiredChannels = (channels == 3 || channels == 4) ? 0 : 4;
+            unsigned char* image = stbi_load_from_memory(source.data(), (int)source.size(), &width, &height, &channels, desiredChannels);
+            if (desiredChannels != 0)
+                channels = desiredChannels;
+
+            if (image && width == job.width && height == job.height)
+            {
+                // Write the rows bottom-up, which flips the y axis on the way out of the decoder
+                const size_t rowBytes = (size_t)width * 4;
+                std::vector<unsigned char> flipped;
+                unsigned char* rgba = destination;
+                if (job.format != GL_RGBA8)
+                {
+                    flipped.resize(rowBytes * height);
+                    rgba = flipped.data();
+                }
+                for (int row = 0; row < height; ++row)
+                {
+                    unsigned char* target = rgba + (size_t)(height - 1 - row) * rowBytes;
+                    if (channels == 3)
+                        UExpandRgbToRgba(image + (size_t)row * width * 3, target, width);
+                    else
+                        memcpy(target, image + (size_t)row * rowBytes, rowBytes);
+                }
+
+                if (job.format == GL_RGBA8)
+                {
+                    // The mip chain follows level 0 in the staging buffer; built here instead of by glGenerateMipmap
+                    unsigned char* level = destination;
+                    for (GLsizei i = 1; i < UTextureLevelCount(width, height); ++i)
+                    {
+                        const int previousWidth = max(1, width >> (i - 1));
+                        const int previousHeight = max(1, height >> (i - 1));
+                        unsigned char* next = level + UTextureLevelBytes(job.format, previousWidth, previousHeight);
+                        UDownsampleRgba(level, previousWidth, previousHeight, next);
+                        level = next;
+                    }
+                }
+                else
+                {
+                    // Encode level by level, box-filtering the RGBA image down in place between levels
+                    unsigned char* level = destination;
+                    for (GLsizei i = 0; i < UTextureLevelCount(width, height); ++i)
+                    {
+                        const int levelWidth = max(1, width >> i);
+                        const int levelHeight = max(1, height >> i);
+                        if (i > 0)
+                            UDownsampleRgba(rgba, max(1, width >> (i - 1)), max(1, height >> (i - 1)), rgba);
+                        UEncodeBcLevel(job.format, rgba, levelWidth, levelHeight, level);
+                        level += UTextureLevelBytes(job.format, levelWidth, levelHeight);
+                    }
+                    UWriteTextureCache(job, sourceHash, destination);
+                }
+                job.decoded = true;
+            }
+            stbi_image_free(image);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(gTextureJobMutex);
+            gFinishedTextureJobs.push_back(index);
+        }
+        gTextureJobReady.notify_one();
+    }
+}
+
+// Number of mip levels down to 1x1
+GLsizei UTextureLevelCount(int width, int height)
+{
+    return 1 + (GLsizei)floor(log2((double)max(width, height)));
+}
+
+// Size of one mip level; BC formats store 4x4 blocks of 8 (BC1) or 16 (BC3) bytes
+size_t UTextureLevelBytes(GLenum format, int width, int height)
+{
+    if (format == GL_RGBA8)
+        return (size_t)width * height * 4;
+
+    const size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+    return blocks * (format == GL_COMPRESSED_RGB_S3TC_DXT1_EXT ? 8 : 16);
+}
+
+// 2x2 box filter of an RGBA8 image to the next mip level; destination may alias source
+void UDownsampleRgba(const unsigned char* source, int width, int height, unsigned char* destination)
+{
+#if defined(USIMD_SSE2)
+    // Odd dimensions need the edge clamp of the scalar path
+    if (width % 2 == 0 && height % 2 == 0)
+    {
+        const int newWidth = width / 2;
+        const int newHeight = height / 2;
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i rounding = _mm_set1_epi16(2);
+
+        for (int y = 0; y < newHeight; ++y)
+        {
+            const unsigned char* row0 = source + (size_t)(2 * y) * width * 4;
+            const unsigned char* row1 = row0 + (size_t)width * 4;
+            unsigned char* output = destination + (size_t)y * newWidth * 4;
+
+            // 8 texels from each of the two rows in, 4 texels out; every read of a step happens before its write,
+            // and the write never reaches texels a later step reads, so in-place filtering stays valid
+            int x = 0;
+            for (; x + 4 <= newWidth; x += 4)
+            {
+                __m128i halves[2];
+                for (int half = 0; half < 2; ++half)
+                {
+                    __m128i top = _mm_loadu_si128((const __m128i*)(row0 + x * 8 + half * 16));
+                    __m128i bottom = _mm_loadu_si128((const __m128i*)(row1 + x * 8 + half * 16));
+
+                    // Widen to 16 bits and add the rows, then add horizontal neighbours
+                    __m128i low = _mm_add_epi16(_mm_unpacklo_epi8(top, zero), _mm_unpacklo_epi8(bottom, zero));
+                    __m128i high = _mm_add_epi16(_mm_unpackhi_epi8(top, zero), _mm_unpackhi_epi8(bottom, zero));
+                    low = _mm_add_epi16(low, _mm_srli_si128(low, 8));
+                    high = _mm_add_epi16(high, _mm_srli_si128(high, 8));
+                    halves[half] = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(low, high), rounding), 2);
+                }
+                _mm_storeu_si128((__m128i*)(output + x * 4), _mm_packus_epi16(halves[0], halves[1]));
+            }
+
+            for (; x < newWidth; ++x)
+                for (int c = 0; c < 4; ++c)
+                {
+                    int sum = row0[x * 8 + c] + row0[x * 8 + 4 + c] + row1[x * 8 + c] + row1[x * 8 + 4 + c];
+                    output[x * 4 + c] = (unsigned char)((sum + 2) / 4);
+                }
+        }
+        return;
+    }
+#endif
+    UDownsampleRgbaScalar(source, width, height, destination);
+}
+
+// Scalar 2x2 box filter; handles odd sizes by clamping to the last row/column
+void UDownsampleRgbaScalar(const unsigned char* source, int width, int height, unsigned char* destination)
+{
+    const int newWidth = max(1, width / 2);
+    const int newHeight = max(1, height / 2);
+
+    for (int y = 0; y < newHeight; ++y)
+    {
+        // Odd or 1-texel dimensions clamp to the last row/column
+        const int y0 = min(2 * y, height - 1), y1 = min(2 * y + 1, height - 1);
+        for (int x = 0; x < newWidth; ++x)
+        {
+            const int x0 = min(2 * x, width - 1), x1 = min(2 * x + 1, width - 1);
+            for (int c = 0; c < 4; ++c)
+            {
+                int sum = source[(y0 * width + x0) * 4 + c] + source[(y0 * width + x1) * 4 + c]
+                        + source[(y1 * width + x0) * 4 + c] + source[(y1 * width + x1) * 4 + c];
+                destination[(y * newWidth + x) * 4 + c] = (unsigned char)((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// Pack an RGB color to 5:6:5
+uint16_t UPack565(const int* rgb)
+{
+    return (uint16_t)(((rgb[0] * 31 + 127) / 255) << 11 | ((rgb[1] * 63 + 127) / 255) << 5 | ((rgb[2] * 31 + 127) / 255));
+}
+
+void UUnpack565(uint16_t color, int* rgb)
+{
+    rgb[0] = ((color >> 11) & 31) * 255 / 31;
+    rgb[1] = ((color >> 5) & 63) * 255 / 63;
+    rgb[2] = (color & 31) * 255 / 31;
+}
+
+// BC1 color block: endpoints from the inset bounding box of the block's colors, then nearest palette entry per texel
+void UEncodeBc1Block(const unsigned char* texels, unsigned char* block)
+{
+    int low[3] = { 255, 255, 255 }, high[3] = { 0, 0, 0 };
+    for (int i = 0; i < 16; ++i)
+        for (int c = 0; c < 3; ++c)
+        {
+            low[c] = min(low[c], (int)texels[i * 4 + c]);
+            high[c] = max(high[c], (int)texels[i * 4 + c]);
+        }
+
+    // Pull the endpoints in by 1/16 of the range, which lowers the error on noisy blocks
+    for (int c = 0; c < 3; ++c)
+    {
+        int inset = (high[c] - low[c]) / 16;
+        low[c] += inset;
+        high[c] -= inset;
+    }
+
+    uint16_t color0 = UPack565(high), color1 = UPack565(low);
+    if (color0 < color1)
+        std::swap(color0, color1);
+
+    uint32_t indices = 0;
+    if (color0 != color1)
+    {
+        // 4-color mode (color0 > color1): c0, c1, 2/3 c0 + 1/3 c1, 1/3 c0 + 2/3 c1
+        int palette[4][3];
+        UUnpack565(color0, palette[0]);
+        UUnpack565(color1, palette[1]);
+        for (int c = 0; c < 3; ++c)
+        {
+            palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+            palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+        }
+
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestError = INT32_MAX;
+            for (int p = 0; p < 4; ++p)
+            {
+                int error = 0;
+                for (int c = 0; c < 3; ++c)
+                {
+                    int d = texels[i * 4 + c] - palette[p][c];
+                    error += d * d;
+                }
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = p;
+                }
+            }
+            indices |= (uint32_t)best << (2 * i);
+        }
+    }
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    block[0] = (unsigned char)(color0 & 0xFF);
+    block[1] = (unsigned char)(color0 >> 8);
+    block[2] = (unsigned char)(color1 & 0xFF);
+    block[3] = (unsigned char)(color1 >> 8);
+    memcpy(block + 4, &indices, 4);
 }
 
+// BC3 alpha block: 8-value ramp between the block's alpha extremes, 3-bit index per texel
+void UEncodeBc3AlphaBlock(const unsigned char* texels, unsigned char* block)
+{
+    int alpha0 = 0, alpha1 = 255;
+    for (int i = 0; i < 16; ++i)
+    {
+        alpha0 = max(alpha0, (int)texels[i * 4 + 3]);
+        alpha1 = min(alpha1, (int)texels[i * 4 + 3]);
+    }
 
-void createWandboxMesh(GLMesh& mesh) {
-    GLfloat verts[] = {
-        // bottom
-       -0.5f,  0.0f, -0.5f,   0.0f, -1.0f, 0.0f,    0.0f, 1.0f,    
-       -0.5f,  0.0f,  0.5f,   0.0f, -1.0f, 0.0f,    0.0f, 0.0f,    
-        0.5f,  0.0f, -0.5f,   0.0f, -1.0f, 0.0f,    1.0f, 1.0f,    
-       -0.5f,  0.0f,  0.5f,   0.0f, -1.0f, 0.0f,    0.0f, 0.0f,    
-        0.5f,  0.0f, -0.5f,   0.0f, -1.0f, 0.0f,    1.0f, 1.0f,    
-        0.5f,  0.0f,  0.5f,   0.0f, -1.0f, 0.0f,    1.0f, 0.0f,    
-
-        // front
-       -0.5f,  0.0f,  0.5f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,    
-       -0.5f,  0.5f,  0.5f,   0.0f, 0.0f, 1.0f,   0.0f, 1.0f,    
-        0.5f,  0.5f,  0.5f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,    
-        0.5f,  0.5f,  0.5f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,    
-        0.5f,  0.0f,  0.5f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,    
-       -0.5f,  0.0f,  0.5f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,    
-
-       // top
-      -0.5f,  0.5f, -0.5f,   0.0f,  1.0f, 0.0f,  0.0f, 1.0f,    
-      -0.5f,  0.5f,  0.5f,   0.0f,  1.0f, 0.0f,  0.0f, 0.0f,    
-       0.5f,  0.5f, -0.5f,   0.0f,  1.0f, 0.0f,  1.0f, 1.0f,    
-       0.5f,  0.5f, -0.5f,   0.0f,  1.0f, 0.0f,  1.0f, 1.0f,   
-      -0.5f,  0.5f,  0.5f,   0.0f,  1.0f, 0.0f,  0.0f, 0.0f,   
-       0.5f,  0.5f,  0.5f,   0.0f,  1.0f, 0.0f,  1.0f, 0.0f,    
-
-       // left side
-       -0.5f,  0.0f,  0.5f,   -1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
-       -0.5f,  0.0f, -0.5f,   -1.0f, 0.0f, 0.0f,   0.0f, 0.0f,   
-       -0.5f,  0.5f, -0.5f,   -1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
-       -0.5f,  0.5f, -0.5f,   -1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
-       -0.5f,  0.0f,  0.5f,   -1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
-       -0.5f,  0.5f,  0.5f,   -1.0f, 0.0f, 0.0f,   1.0f, 1.0f,    
-
-
-       // right side
-       0.5f,  0.0f,  0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 0.0f,    
-       0.5f,  0.0f, -0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 0.0f,    
-       0.5f,  0.5f, -0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 1.0f,  
-       0.5f,  0.5f, -0.5f,   0.0f, 1.0f, 0.0f,   0.0f, 1.0f,   
-       0.5f,  0.0f,  0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 0.0f,    
-       0.5f,  0.5f,  0.5f,   0.0f, 1.0f, 0.0f,   1.0f, 1.0f,    
-
-
-       //back
-      -0.5f,  0.0f, -0.5f,   0.0f,  0.0f, -1.0f,  0.0f, 0.0f,   
-       0.5f,  0.5f, -0.5f,   0.0f,  0.0f, -1.0f,  1.0f, 1.0f,    
-      -0.5f,  0.5f, -0.5f,   0.0f,  0.0f, -1.0f,  0.0f, 1.0f,    
-      -0.5f,  0.0f, -0.5f,   0.0f,  0.0f, -1.0f,  0.0f, 0.0f,  
-       0.5f,  0.5f, -0.5f,   0.0f,  0.0f, -1.0f,  1.0f, 1.0f,   
-       0.5f,  0.0f, -0.5f,   0.0f,  0.0f, -1.0f,  1.0f, 0.0f,   
-    };
+    uint64_t indices = 0;
+    if (alpha0 != alpha1)
+    {
+        // alpha0 > alpha1: index 0 is alpha0, 1 is alpha1, 2..7 interpolate from alpha0 towards alpha1
+        int palette[8] = { alpha0, alpha1 };
+        for (int p = 1; p < 7; ++p)
+            palette[p + 1] = ((7 - p) * alpha0 + p * alpha1) / 7;
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+        for (int i = 0; i < 16; ++i)
+        {
+            int best = 0, bestError = INT32_MAX;
+            for (int p = 0; p < 8; ++p)
+            {
+                int error = abs(texels[i * 4 + 3] - palette[p]);
+                if (error < bestError)
+                {
+                    bestError = error;
+                    best = p;
+                }
+            }
+            indices |= (uint64_t)best << (3 * i);
+        }
+    }
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    block[0] = (unsigned char)alpha0;
+    block[1] = (unsigned char)alpha1;
+    for (int i = 0; i < 6; ++i)
+        block[2 + i] = (unsigned char)(indices >> (8 * i));
+}
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+// Compress one RGBA8 mip level to BC1 or BC3; edge blocks repeat the last row/column
+void UEncodeBcLevel(GLenum format, const unsigned char* rgba, int width, int height, unsigned char* destination)
+{
+    const bool hasAlpha = format != GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+    unsigned char texels[16 * 4];
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); 
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); 
+    for (int blockY = 0; blockY < height; blockY += 4)
+    {
+        for (int blockX = 0; blockX < width; blockX += 4)
+        {
+            for (int y = 0; y < 4; ++y)
+                for (int x = 0; x < 4; ++x)
+                {
+                    const int sourceX = min(blockX + x, width - 1), sourceY = min(blockY + y, height - 1);
+                    memcpy(texels + (y * 4 + x) * 4, rgba + ((size_t)sourceY * width + sourceX) * 4, 4);
+                }
+
+            if (hasAlpha)
+            {
+                UEncodeBc3AlphaBlock(texels, destination);
+                destination += 8;
+            }
+            UEncodeBc1Block(texels, destination);
+            destination += 8;
+        }
+    }
+}
 
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);
+// Read the compressed levels of a texture from its cache file if it matches the current source
+bool UReadTextureCache(const TextureJob& job, uint64_t sourceHash, unsigned char* destination)
+{
+    std::ifstream file(job.filename + ".bct", std::ios::binary);
+    if (!file)
+        return false;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    TextureCacheHeader header;
+    if (!file.read((char*)&header, sizeof(header)))
+        return false;
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    if (memcmp(header.magic, "UBCT", 4) != 0 || header.version != TEXTURE_CACHE_VERSION
+        || header.sourceHash != sourceHash || header.format != job.format
+        || header.width != (uint32_t)job.width || header.height != (uint32_t)job.height
+        || header.levels != (uint32_t)UTextureLevelCount(job.width, job.height))
+        return false; // Stale or foreign file; re-encode and overwrite it
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    return (bool)file.read((char*)destination, job.stagingBytes);
 }
 
+// Store the compressed levels of a texture so later runs skip decoding and encoding
+void UWriteTextureCache(const TextureJob& job, uint64_t sourceHash, const unsigned char* data)
+{
+    TextureCacheHeader header = { { 'U', 'B', 'C', 'T' }, TEXTURE_CACHE_VERSION, sourceHash, job.format,
+        (uint32_t)job.width, (uint32_t)job.height, (uint32_t)UTextureLevelCount(job.width, job.height) };
 
-void createPagesMesh(GLMesh& mesh) {
-    GLfloat verts[] = {
-        // bottom of pages
-       -1.0f,  0.0f, -1.0f,   0.0f, -1.0f, 0.0f,    0.0f, 1.0f,    
-       -1.0f,  0.0f,  1.0f,   0.0f, -1.0f, 0.0f,    0.0f, 0.0f,   
-        1.0f,  0.0f, -1.0f,   0.0f, -1.0f, 0.0f,    1.0f, 1.0f,   
-       -1.0f,  0.0f,  1.0f,   0.0f, -1.0f, 0.0f,    0.0f, 0.0f,
-        1.0f,  0.0f, -1.0f,   0.0f, -1.0f, 0.0f,    1.0f, 1.0f,
-        1.0f,  0.0f,  1.0f,   0.0f, -1.0f, 0.0f,    1.0f, 0.0f,
+    std::ofstream file(job.filename + ".bct", std::ios::binary | std::ios::trunc);
+    if (!file.write((const char*)&header, sizeof(header)) || !file.write((const char*)data, job.stagingBytes))
+        cout << "WARNING: Could not write texture cache for " << job.filename << endl; // Next run encodes again
+}
 
-        // front of pages
-       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
-       -1.0f,  1.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 1.0f,
-        1.0f,  1.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,
-        1.0f,  1.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 1.0f,
-        1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   1.0f, 0.0f,
-       -1.0f,  0.0f,  1.0f,   0.0f, 0.0f, 1.0f,   0.0f, 0.0f,
+/*Decode every registered texture on a worker pool and pack it into a GL_TEXTURE_2D_ARRAY with the
+other textures of the same size and format, uploading each one from a pixel buffer object as soon as it is decoded*/
+bool UBuildTextureArrays()
+{
+    auto startTime = std::chrono::steady_clock::now();
 
-        // top of pages
-       -1.0f,  1.0f, -1.0f,   0.0f,  1.0f, 0.0f,  0.0f, 0.25f,
-       -1.0f,  1.0f,  1.0f,   0.0f,  1.0f, 0.0f,  0.0f, 0.75f,
-        1.0f,  1.0f, -1.0f,   0.0f,  1.0f, 0.0f,  1.0f, 0.25f,
-        1.0f,  1.0f, -1.0f,   0.0f,  1.0f, 0.0f,  1.0f, 0.25f,
-       -1.0f,  1.0f,  1.0f,   0.0f,  1.0f, 0.0f,  0.0f, 0.75f,
-        1.0f,  1.0f,  1.0f,   0.0f,  1.0f, 0.0f,  1.0f, 0.75f
-    };
+    // One array per image size and format; the layers are known from the headers before anything is decoded
+    std::vector<bool> assigned(gTextureJobs.size(), false);
+    size_t stagingBytes = 0;
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    for (size_t first = 0; first < gTextureJobs.size(); ++first)
+    {
+        if (assigned[first])
+            continue;
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+        const int width = gTextureJobs[first].width;
+        const int height = gTextureJobs[first].height;
+        const GLenum format = gTextureJobs[first].format;
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+        GLuint textureArray;
+        glGenTextures(1, &textureArray);
+        gTextureArrays.push_back(textureArray);
+        assert(gTextureArrays.size() < 0xFF && "texture array slot must fit the 8-bit sort key field");
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+        GLuint layerCount = 0;
+        for (size_t i = first; i < gTextureJobs.size(); ++i)
+        {
+            TextureJob& job = gTextureJobs[i];
+            if (assigned[i] || job.width != width || job.height != height || job.format != format)
+                continue;
+
+            gMaterials[job.material] = Material{ textureArray, layerCount++, (GLuint)gTextureArrays.size() - 1 };
+            job.stagingOffset = stagingBytes;
+            stagingBytes += job.stagingBytes;
+            assigned[i] = true;
+        }
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+        glBindTexture(GL_TEXTURE_2D_ARRAY, textureArray);
+        glTexStorage3D(GL_TEXTURE_2D_ARRAY, UTextureLevelCount(width, height), format, width, height, layerCount);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+        // set the texture wrapping parameters
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+        // set texture filtering parameters; every mip level is uploaded, so minification samples the chain
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    }
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    if (gTextureJobs.empty())
+        return true;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
-}
+    // Persistently mapped staging PBO the workers decode into, so the main thread never copies pixels
+    GLuint stagingBuffer;
+    const GLbitfield mapFlags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &stagingBuffer);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stagingBuffer);
+    glBufferStorage(GL_PIXEL_UNPACK_BUFFER, stagingBytes, NULL, mapFlags);
+    gTextureStaging = (unsigned char*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, stagingBytes, mapFlags);
+    if (!gTextureStaging)
+    {
+        cout << "Failed to map the texture staging buffer" << endl;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &stagingBuffer);
+        return false;
+    }
 
-void createBookCoverMesh(GLMesh& mesh) {
-    GLfloat verts[] = {
-        // left side of book
-       -0.5f,  0.0f,  1.0f,   -1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
-       -0.5f,  0.0f, -1.0f,   -1.0f, 0.0f, 0.0f,   0.0f, 0.0f,   
-       -0.5f,  3.0f, -1.0f,   -1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
-       -0.5f,  3.0f, -1.0f,   -1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
-       -0.5f,  0.0f,  1.0f,   -1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
-       -0.5f,  3.0f,  1.0f,   -1.0f, 0.0f, 0.0f,   1.0f, 1.0f,    
+    gNextTextureJob = 0;
+    gFinishedTextureJobs.clear();
 
-        // right side of book
-        0.5f,  0.0f,  1.0f,   1.0f, 0.0f, 0.0f,   1.0f, 0.0f,    
-        0.5f,  0.0f, -1.0f,   1.0f, 0.0f, 0.0f,   0.0f, 0.0f,    
-        0.5f,  3.0f, -1.0f,   1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
-        0.5f,  3.0f, -1.0f,   1.0f, 0.0f, 0.0f,   0.0f, 1.0f,    
-        0.5f,  0.0f,  1.0f,   1.0f, 0.0f, 0.0f,   1.0f, 0.0f,   
-        0.5f,  3.0f,  1.0f,   1.0f, 0.0f, 0.0f,   1.0f, 1.0f,  
+    const size_t workerCount = max<size_t>(1, min<size_t>(std::thread::hardware_concurrency(), gTextureJobs.size()));
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < workerCount; ++i)
+        workers.emplace_back(UDecodeTextureWorker);
 
-        // spine of book
-       -0.5f,  0.0f, -1.0f,   0.0f,  0.0f, -1.0f,  0.0f, 0.0f,    
-        0.5f,  3.0f, -1.0f,   0.0f,  0.0f, -1.0f,  1.0f, 1.0f, 
-       -0.5f,  3.0f, -1.0f,   0.0f,  0.0f, -1.0f,  0.0f, 1.0f,   
-       -0.5f,  0.0f, -1.0f,   0.0f,  0.0f, -1.0f,  0.0f, 0.0f,    
-        0.5f,  3.0f, -1.0f,   0.0f,  0.0f, -1.0f,  1.0f, 1.0f,    
-        0.5f,  0.0f, -1.0f,   0.0f,  0.0f, -1.0f,  1.0f, 0.0f,    
-    };
+    // Upload each texture as its decode finishes; the copy out of the PBO runs asynchronously on the GPU
+    bool success = true;
+    for (size_t uploaded = 0; uploaded < gTextureJobs.size(); ++uploaded)
+    {
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock(gTextureJobMutex);
+            gTextureJobReady.wait(lock, [] { return !gFinishedTextureJobs.empty(); });
+            index = gFinishedTextureJobs.back();
+            gFinishedTextureJobs.pop_back();
+        }
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+        const TextureJob& job = gTextureJobs[index];
+        if (!job.decoded)
+        {
+            cout << "Failed to load texture: " << job.filename << endl;
+            success = false;
+            continue;
+        }
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+        const Material& placement = gMaterials[job.material];
+        glBindTexture(GL_TEXTURE_2D_ARRAY, placement.textureArray);
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+        // Every texture carries its whole mip chain
+        size_t offset = job.stagingOffset;
+        for (GLsizei level = 0; level < UTextureLevelCount(job.width, job.height); ++level)
+        {
+            const int levelWidth = max(1, job.width >> level);
+            const int levelHeight = max(1, job.height >> level);
+            const size_t levelBytes = UTextureLevelBytes(job.format, levelWidth, levelHeight);
+            if (job.format == GL_RGBA8)
+                glTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, (GLint)placement.layer, levelWidth, levelHeight, 1,
+                    GL_RGBA, GL_UNSIGNED_BYTE, (const void*)offset);
+            else
+                glCompressedTexSubImage3D(GL_TEXTURE_2D_ARRAY, level, 0, 0, (GLint)placement.layer, levelWidth, levelHeight, 1,
+                    job.format, (GLsizei)levelBytes, (const void*)offset);
+            offset += levelBytes;
+        }
+    }
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    for (std::thread& worker : workers)
+        worker.join();
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+    glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &stagingBuffer); // GL keeps the storage alive until the pending uploads complete
+    gTextureStaging = nullptr;
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    size_t cachedCount = 0;
+    for (const TextureJob& job : gTextureJobs)
+        cachedCount += job.cached ? 1 : 0;
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0); // Unbind the texture
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    double loadMs = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+    cout << "INFO: Loaded " << gTextureJobs.size() << " textures (" << cachedCount << " from the compressed cache) into "
+         << gTextureArrays.size() << " texture array(s) on " << workerCount << " thread(s) in " << loadMs << " ms" << endl;
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    gTextureJobs.clear();
+    return success;
 }
 
-void createMugMesh(GLMesh& mesh) {
-    GLfloat verts[] = {
-        // Base 
-
-        -1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+// Weld identical vertices of a triangle list and append it to the mesh arena as an indexed mesh
+void UCreateIndexedMesh(const GLfloat* verts, size_t floatCount, GLDoubleMesh& mesh)
+{
+    const size_t soupVertices = floatCount / FLOATS_PER_VERTEX;
 
-        -0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+    std::vector<GLfloat> vertices;
+    std::vector<GLuint> indices;
+    std::unordered_map<VertexKey, GLuint, VertexKeyHash> welded;
+    vertices.reserve(floatCount);
+    indices.reserve(soupVertices);
+    welded.reserve(soupVertices);
 
-        -0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+    for (size_t v = 0; v < soupVertices; ++v)
+    {
+        VertexKey key;
+        for (GLuint f = 0; f < FLOATS_PER_VERTEX; ++f)
+        {
+            // -0.0f and 0.0f compare equal but have different bits
+            GLfloat value = verts[v * FLOATS_PER_VERTEX + f];
+            key.values[f] = (value == 0.0f) ? 0.0f : value;
+        }
 
-        -0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+        auto found = welded.find(key);
+        if (found != welded.end())
+        {
+            indices.push_back(found->second);
+            continue;
+        }
 
-        -0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,    0.0f, -1.0f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+        GLuint index = (GLuint)(vertices.size() / FLOATS_PER_VERTEX);
+        welded.emplace(key, index);
+        vertices.insert(vertices.end(), key.values, key.values + FLOATS_PER_VERTEX);
+        indices.push_back(index);
+    }
 
-         0.0f,    0.0f, -1.0f,      1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+    mesh.nVertices = (GLuint)(vertices.size() / FLOATS_PER_VERTEX);
+    mesh.nIndices = (GLuint)indices.size();
 
-         0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+    // Bounds of the positions (the first 3 floats of each vertex)
+    mesh.boundsMin = glm::vec3(FLT_MAX);
+    mesh.boundsMax = glm::vec3(-FLT_MAX);
+    for (size_t v = 0; v < vertices.size(); v += FLOATS_PER_VERTEX)
+    {
+        glm::vec3 position(vertices[v], vertices[v + 1], vertices[v + 2]);
+        mesh.boundsMin = glm::min(mesh.boundsMin, position);
+        mesh.boundsMax = glm::max(mesh.boundsMax, position);
+    }
+    mesh.sphereCenter = (mesh.boundsMin + mesh.boundsMax) * 0.5f;
+    mesh.sphereRadius = glm::length(mesh.boundsMax - mesh.boundsMin) * 0.5f;
+
+    // Grow the arena buffers (keeping their contents) if the mesh does not fit
+    MeshArena& arena = gMeshArena;
+    if (arena.vertexCount + mesh.nVertices > arena.vertexCapacity) {
+        GLuint capacity = max(arena.vertexCapacity * 2, arena.vertexCount + mesh.nVertices);
+        UGrowArenaBuffer(arena.vertexBuffer, arena.vertexCount * FLOATS_PER_VERTEX * sizeof(GLfloat),
+            capacity * FLOATS_PER_VERTEX * sizeof(GLfloat));
+        arena.vertexCapacity = capacity;
+
+        glBindVertexArray(arena.vao);
+        glBindVertexBuffer(0, arena.vertexBuffer, 0, sizeof(GLfloat) * FLOATS_PER_VERTEX);
+        glBindVertexArray(0);
+    }
+    if (arena.indexCount + mesh.nIndices > arena.indexCapacity) {
+        GLuint capacity = max(arena.indexCapacity * 2, arena.indexCount + mesh.nIndices);
+        UGrowArenaBuffer(arena.indexBuffer, arena.indexCount * sizeof(GLuint), capacity * sizeof(GLuint));
+        arena.indexCapacity = capacity;
+
+        glBindVertexArray(arena.vao);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.indexBuffer);
+        glBindVertexArray(0);
+    }
 
-         0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+    mesh.vao = arena.vao;
+    mesh.vbos[0] = arena.vertexBuffer;
+    mesh.vbos[1] = arena.indexBuffer;
+    mesh.baseVertex = (GLint)arena.vertexCount;
+    mesh.firstIndex = arena.indexCount;
+    mesh.arenaId = arena.meshCount++;
+    assert(mesh.arenaId <= 0xFFF && "arena mesh id must fit the 12-bit sort key field");
+
+    // Indices stay mesh-relative; baseVertex in the draw command offsets them
+    glBindBuffer(GL_ARRAY_BUFFER, arena.vertexBuffer);
+    glBufferSubData(GL_ARRAY_BUFFER, arena.vertexCount * FLOATS_PER_VERTEX * sizeof(GLfloat),
+        vertices.size() * sizeof(GLfloat), vertices.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_COPY_WRITE_BUFFER, arena.indexBuffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, arena.indexCount * sizeof(GLuint), indices.size() * sizeof(GLuint), indices.data());
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+
+    arena.vertexCount += mesh.nVertices;
+    arena.indexCount += mesh.nIndices;
+}
 
-         0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+// One VAO over the shared vertex and index buffers
+void UCreateMeshArena(GLuint vertexCapacity, GLuint indexCapacity)
+{
+    MeshArena& arena = gMeshArena;
+    arena.vertexCount = 0;
+    arena.indexCount = 0;
+    arena.meshCount = 0;
+    arena.vertexCapacity = vertexCapacity;
+    arena.indexCapacity = indexCapacity;
 
-         0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+    glGenVertexArrays(1, &arena.vao);
+    glBindVertexArray(arena.vao);
 
-         1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
+    // Create 2 buffers: first one for the vertex data; second one for the indices
+    glGenBuffers(1, &arena.vertexBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, arena.vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexCapacity * FLOATS_PER_VERTEX * sizeof(GLfloat), NULL, GL_STATIC_DRAW);
 
-         0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-         0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-         0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-         0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,    0.0f,  1.0f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-         0.0f,    0.0f,  1.0f,      1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-        -0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-        -0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-        -0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-        -0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.5f, 0.0f,
-
-
-         // Side 1
-         0.0f,    0.0f,  1.0f,     1.0f, 0.0f,  1.0f,    0.0f, 0.0f,
-         0.0f,    1.0f,  1.2f,     1.0f, 0.0f,  1.0f,    0.0f, 1.0f,
-         0.371f,  1.0f,  1.141f,   1.0f, 0.0f,  1.0f,    1.0f, 1.0f,
-
-         0.0f,    0.0f,  1.0f,     1.0f, 0.0f,  1.0f,    0.0f, 0.0f,
-         0.371f,  1.0f,  1.141f,   1.0f, 0.0f,  1.0f,    1.0f, 1.0f,
-         0.309f,  0.0f,  0.951f,   1.0f, 0.0f,  1.0f,    1.0f, 0.0f,
-
-         // Side 2
-         0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.371f,  1.0f,  1.141f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.706f,  1.0f,  0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.706f,  1.0f,  0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 3
-         0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.706f,  1.0f,  0.971f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.971f,  1.0f,  0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.971f,  1.0f,  0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 4
-         0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.971f,  1.0f,  0.706f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         1.141f,  1.0f,  0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         1.141f,  1.0f,  0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 5
-         0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         1.141f,  1.0f,  0.371f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         1.2f,    1.0f,  0.0f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         1.2f,    1.0f,  0.0f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 6
-         1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         1.2f,    1.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         1.141f,  1.0f, -0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         1.141f,  1.0f, -0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 7
-         0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         1.141f,  1.0f, -0.371f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.971f,  1.0f, -0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.971f,  1.0f, -0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 8
-         0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.971f,  1.0f, -0.706f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.706f,  1.0f, -0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.706f,  1.0f, -0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 9
-         0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.706f,  1.0f, -0.971f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.371f,  1.0f, -1.141f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.371f,  1.0f, -1.141f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 10
-         0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.371f,  1.0f, -1.141f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,    1.0f, -1.2f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.0f,    1.0f, -1.2f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f, -1.0f,      1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 11
-         0.0f,    0.0f, -1.0f,      1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.0f,    1.0f, -1.2f,      1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.371f,  1.0f, -1.141f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-         0.0f,    0.0f, -1.0f,      1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.371f,  1.0f, -1.141f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 12
-        -0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.371f,  1.0f, -1.141f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.706f,  1.0f, -0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.309f,  0.0f, -0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.706f,  1.0f, -0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 13
-        -0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.706f,  1.0f, -0.971f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.971f,  1.0f, -0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.588f,  0.0f, -0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.971f,  1.0f, -0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 14
-        -0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.971f,  1.0f, -0.706f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -1.141f,  1.0f, -0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         
-        -0.809f,  0.0f, -0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -1.141f,  1.0f, -0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 15
-        -0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -1.141f,  1.0f, -0.371f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -1.2f,    1.0f, 0.0f,       1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.951f,  0.0f, -0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -1.2f,    1.0f,  0.0f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 16
-        -1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -1.2f,    1.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -1.141f,  1.0f,  0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -1.0f,    0.0f,  0.0f,      1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -1.141f,  1.0f,  0.371f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-         
-         // Side 17
-        -0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -1.141f,  1.0f,  0.371f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.971f,  1.0f,  0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.951f,  0.0f,  0.309f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.971f,  1.0f,  0.706f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 18
-        -0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.971f,  1.0f,  0.706f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.706f,  1.0f,  0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.809f,  0.0f,  0.588f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.706f,  1.0f,  0.971f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 19
-        -0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.706f,  1.0f,  0.971f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-        -0.371f,  1.0f,  1.141f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.588f,  0.0f,  0.809f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.371f,  1.0f,  1.141f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-        -0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-
-         // Side 20
-        -0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.371f,  1.0f,  1.141f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,    1.0f,  1.2f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.309f,  0.0f,  0.951f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.0f,    1.0f,  1.2f,      1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-         0.0f,    0.0f,  1.0f,      1.0f, 0.0f, 1.0f,    1.0f, 0.0f,
-    };
+    glGenBuffers(1, &arena.indexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, arena.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexCapacity * sizeof(GLuint), NULL, GL_STATIC_DRAW);
 
     const GLuint floatsPerVertex = 3;
     const GLuint floatsPerNormal = 3;
     const GLuint floatsPerUV = 2;
 
-
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
-
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
-
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
-
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
-
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
+    // Attribute formats are fixed; growing the arena only rebinds the buffer at binding 0
+    glVertexAttribFormat(0, floatsPerVertex, GL_FLOAT, GL_FALSE, 0);
+    glVertexAttribBinding(0, 0);
     glEnableVertexAttribArray(0);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
+    glVertexAttribFormat(1, floatsPerNormal, GL_FLOAT, GL_FALSE, sizeof(float) * floatsPerVertex);
+    glVertexAttribBinding(1, 0);
     glEnableVertexAttribArray(1);
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
+    glVertexAttribFormat(2, floatsPerUV, GL_FLOAT, GL_FALSE, sizeof(float) * (floatsPerVertex + floatsPerNormal));
+    glVertexAttribBinding(2, 0);
     glEnableVertexAttribArray(2);
-}
 
-void createWandMesh(GLMesh& mesh) {
-    GLfloat verts[] = {
-        // Base 
-
-        -1.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.7f,  0.0f, -0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-        -0.7f,  0.0f, -0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.0f,  0.0f, -1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
+    glBindVertexBuffer(0, arena.vertexBuffer, 0, sizeof(GLfloat) * FLOATS_PER_VERTEX);
 
-         0.0f,  0.0f, -1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.7f,  0.0f, -0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
 
-         0.7f,  0.0f, -0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         1.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
+// Replace an arena buffer with a larger one, copying the bytes already in use
+void UGrowArenaBuffer(GLuint& buffer, size_t usedBytes, size_t newBytes)
+{
+    GLuint grown;
+    glGenBuffers(1, &grown);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, grown);
+    glBufferData(GL_COPY_WRITE_BUFFER, newBytes, NULL, GL_STATIC_DRAW);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, buffer);
+    glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_COPY_WRITE_BUFFER, 0, 0, usedBytes);
+
+    glBindBuffer(GL_COPY_READ_BUFFER, 0);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    glDeleteBuffers(1, &buffer);
+    buffer = grown;
+}
 
-         1.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
+void UDestroyMeshArena()
+{
+    glDeleteVertexArrays(1, &gMeshArena.vao);
+    glDeleteBuffers(1, &gMeshArena.vertexBuffer);
+    glDeleteBuffers(1, &gMeshArena.indexBuffer);
+}
 
-         0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-         0.0f,  0.0f,  1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
+// Destroy mesh; its arena space is released with the arena
+void UDestroyMesh(GLDoubleMesh& mesh)
+{
+    mesh.nIndices = 0;
+    mesh.nVertices = 0;
+}
 
-         0.0f,  0.0f,  1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
 
-        -0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-        -1.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-         0.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
+// Destroy the texture arrays backing every material
+void UDestroyTextureArrays()
+{
+    if (!gTextureArrays.empty())
+        glDeleteTextures((GLsizei)gTextureArrays.size(), gTextureArrays.data());
+    gTextureArrays.clear();
+    gMaterials.clear();
+}
 
+// Implements the UCreateShaders function: starts the compile and link without waiting on the driver
+bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+{
+    ShaderProgram entry;
+    entry.program = 0;
+    entry.vertexShader = 0;
+    entry.fragmentShader = 0;
+    entry.vertexSource = vtxShaderSource;
+    entry.fragmentSource = fragShaderSource;
+    entry.cacheKey = UProgramCacheKey(vtxShaderSource, fragShaderSource);
+    entry.state = PROGRAM_COMPILING;
+
+    // Reuse the binary of a previous run when the sources and driver are unchanged
+    entry.fromBinary = gHasProgramBinary && ULoadProgramBinary(entry.cacheKey, entry.program);
+    if (!entry.fromBinary)
+        UStartProgramCompile(entry);
+
+    if (entry.program == 0)
+    {
+        std::cout << "ERROR::SHADER::PROGRAM::CREATION_FAILED" << std::endl;
+        return false;
+    }
 
-         // Side 1
-        -1.0f,  0.0f,  0.0f,   -1.0f, 0.0f,  1.0f,    0.0f, 0.0f,
-        -1.0f,  1.0f,  0.0f,   -1.0f, 0.0f,  1.0f,    0.0f, 1.0f,
-        -0.7f,  1.0f, -0.7f,   -1.0f, 0.0f,  1.0f,    1.0f, 1.0f,
-
-        -1.0f,  0.0f,  0.0f,   -1.0f, 0.0f,  1.0f,    0.0f, 0.0f,
-        -0.7f,  0.0f, -0.7f,   -1.0f, 0.0f,  1.0f,    0.0f, 1.0f,
-        -0.7f,  1.0f, -0.7f,   -1.0f, 0.0f,  1.0f,    1.0f, 1.0f,
-
-        // Side 2
-       -0.7f,  0.0f, -0.7f,    1.0f, 0.0f, -1.0f,    0.0f, 0.0f,
-       -0.7f,  1.0f, -0.7f,    1.0f, 0.0f, -1.0f,    0.0f, 1.0f,
-        0.0f,  1.0f, -1.0f,    1.0f, 0.0f, -1.0f,    1.0f, 1.0f,
-
-       -0.7f,  0.0f, -0.7f,    1.0f, 0.0f, -1.0f,    0.0f, 0.0f,
-        0.0f,  0.0f, -1.0f,    1.0f, 0.0f, -1.0f,    0.0f, 1.0f,
-        0.0f,  1.0f, -1.0f,    1.0f, 0.0f, -1.0f,    1.0f, 1.0f,
-
-        // Side 3
-       0.0f,  0.0f, -1.0f,    1.0f, 0.0f, -1.0f,    0.0f, 0.0f,
-       0.0f,  1.0f, -1.0f,    1.0f, 0.0f, -1.0f,    0.0f, 1.0f,
-       0.7f,  1.0f, -0.7f,    1.0f, 0.0f, -1.0f,    1.0f, 1.0f,
-
-       0.0f,  0.0f, -1.0f,    1.0f, 0.0f, -1.0f,    0.0f, 0.0f,
-       0.7f,  0.0f, -0.7f,    1.0f, 0.0f, -1.0f,    0.0f, 1.0f,
-       0.7f,  1.0f, -0.7f,    1.0f, 0.0f, -1.0f,    1.0f, 1.0f,
-
-       // Side 4
-       0.7f,  0.0f, -0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-       0.7f,  1.0f, -0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-       1.0f,  1.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-       0.7f,  0.0f, -0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-       1.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-       1.0f,  1.0f,  0.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-       // Side 5
-      1.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-      1.0f,  1.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-      0.7f,  1.0f,  0.7f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-      1.0f,  0.0f,  0.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-      0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-      0.7f,  1.0f,  0.7f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-      // Side 6
-     0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-     0.7f,  1.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-     0.0f,  1.0f,  1.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-     0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-     0.0f,  0.0f,  1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-     0.0f,  1.0f,  1.0f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-     // Side 7
-     0.0f,  0.0f,  1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-     0.0f,  1.0f,  1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-    -0.7f,  1.0f,  0.7f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-     0.0f,  0.0f,  1.0f,    1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-    -0.7f,  0.0f,  0.7f,    1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-    -0.7f,  1.0f,  0.7f,    1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-    // Side 8
-    -0.7f,  0.0f,  0.7f,    -1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-    -0.7f,  1.0f,  0.7f,    -1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-    -1.0f,  1.0f,  0.0f,    -1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-    -0.7f,  0.0f,  0.7f,    -1.0f, 0.0f, 1.0f,    0.0f, 0.0f,
-    -1.0f,  0.0f,  0.0f,    -1.0f, 0.0f, 1.0f,    0.0f, 1.0f,
-    -1.0f,  1.0f,  0.0f,    -1.0f, 0.0f, 1.0f,    1.0f, 1.0f,
-
-
-    // Top 
-   -1.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,   
-   -0.7f,  1.0f, -0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,  
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,   
-
-   -0.7f,  1.0f, -0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,     
-    0.0f,  1.0f, -1.0f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,    
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,   
-
-    0.0f,  1.0f, -1.0f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,    
-    0.7f,  1.0f, -0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,    
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,    
-
-    0.7f,  1.0f, -0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,    
-    1.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,   
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,     
-
-    1.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,    
-    0.7f,  1.0f,  0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,     
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,    
-
-    0.7f,  1.0f,  0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,    
-    0.0f,  1.0f,  1.0f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,   
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,   
-
-    0.0f,  1.0f,  1.0f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,    
-   -0.7f,  1.0f,  0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,     
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,     
-
-   -0.7f,  1.0f,  0.7f,    0.0f, 1.0f, 0.0f,    0.0f, 0.0f,     
-   -1.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    0.0f, 1.0f,     
-    0.0f,  1.0f,  0.0f,    0.0f, 1.0f, 0.0f,    1.0f, 1.0f,     
-    };
+    programId = entry.program;
+    gShaderPrograms.push_back(entry);
+    USetDrawProgram(programId, gFallbackProgramId);
 
-    const GLuint floatsPerVertex = 3;
-    const GLuint floatsPerNormal = 3;
-    const GLuint floatsPerUV = 2;
+    // GL names are sparse; the sort key needs a small dense index
+    if (gProgramSortIndices.size() <= programId)
+        gProgramSortIndices.resize(programId + 1, 0);
+    gProgramSortIndices[programId] = (GLuint)gShaderPrograms.size() - 1;
+    assert(gShaderPrograms.size() <= 0x100 && "program slot must fit the 8-bit sort key field");
+    return true;
+}
 
+// Queue compilation of both stages and the link; no status is queried here, so the driver is never waited on
+void UStartProgramCompile(ShaderProgram& entry)
+{
+    // A program object whose cached binary was rejected is reused, so its name stays valid
+    if (entry.program == 0)
+        entry.program = glCreateProgram();
 
-    mesh.nVertices = sizeof(verts) / (sizeof(verts[0]) * (floatsPerVertex + floatsPerNormal + floatsPerUV));
+    const char* vtxShaderSource = entry.vertexSource.c_str();
+    const char* fragShaderSource = entry.fragmentSource.c_str();
 
-    glGenVertexArrays(1, &mesh.vao); // we can also generate multiple VAOs or buffers at the same time
-    glBindVertexArray(mesh.vao);
+    // Create the vertex and fragment shader objects
+    entry.vertexShader = glCreateShader(GL_VERTEX_SHADER);
+    entry.fragmentShader = glCreateShader(GL_FRAGMENT_SHADER);
 
-    // Create 2 buffers: first one for the vertex data; second one for the indices
-    glGenBuffers(1, &mesh.vbo);
-    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo); // Activates the buffer
-    glBufferData(GL_ARRAY_BUFFER, sizeof(verts), verts, GL_STATIC_DRAW); // Sends vertex or coordinate data to the GPU
+    // Retrive the shader source
+    glShaderSource(entry.vertexShader, 1, &vtxShaderSource, NULL);
+    glShaderSource(entry.fragmentShader, 1, &fragShaderSource, NULL);
 
-    // Strides between vertex coordinates is 6 (x, y, z, r, g, b, a). A tightly packed stride is 0.
-    GLint stride = sizeof(float) * (floatsPerVertex + floatsPerNormal + floatsPerUV);// The number of floats before each
+    glCompileShader(entry.vertexShader);
+    glCompileShader(entry.fragmentShader);
 
-    // Create Vertex Attribute Pointers
-    glVertexAttribPointer(0, floatsPerVertex, GL_FLOAT, GL_FALSE, stride, 0);
-    glEnableVertexAttribArray(0);
+    // Attached compiled shaders to the shader program
+    glAttachShader(entry.program, entry.vertexShader);
+    glAttachShader(entry.program, entry.fragmentShader);
 
-    glVertexAttribPointer(1, floatsPerNormal, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * floatsPerVertex));
-    glEnableVertexAttribArray(1);
+    glProgramParameteri(entry.program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    glLinkProgram(entry.program);   // links the shader program
 
-    glVertexAttribPointer(2, floatsPerUV, GL_FLOAT, GL_FALSE, stride, (void*)(sizeof(float) * (floatsPerVertex + floatsPerNormal)));
-    glEnableVertexAttribArray(2);
+    entry.fromBinary = false;
 }
 
-
-/*Generate and load the texture*/
-bool UCreateTexture(const char* filename, GLuint& textureId)
+// Resolve a compiling program. Without wait, GL_KHR_parallel_shader_compile lets this return at once while the
+// driver is still busy; without the extension the status query itself blocks until the link is done
+ProgramState UPollShaderProgram(ShaderProgram& entry, bool wait)
 {
-    int width, height, channels;
-    unsigned char* image = stbi_load(filename, &width, &height, &channels, 0);
-    if (image)
+    if (entry.state != PROGRAM_COMPILING)
+        return entry.state;
+
+    if (!wait && gHasParallelShaderCompile)
     {
-        flipImageVertically(image, width, height, channels);
+        GLint completed = GL_FALSE;
+        glGetProgramiv(entry.program, GL_COMPLETION_STATUS_KHR, &completed);
+        if (!completed)
+            return PROGRAM_COMPILING;
+    }
 
-        glGenTextures(1, &textureId);
-        glBindTexture(GL_TEXTURE_2D, textureId);
+    // Compilation and linkage error reporting
+    int success = 0;
+    char infoLog[512];
 
-        // set the texture wrapping parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-        // set texture filtering parameters
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glGetProgramiv(entry.program, GL_LINK_STATUS, &success);
+    if (!success && entry.fromBinary)
+    {
+        // Drivers may reject binaries they produced themselves, e.g. after an update that kept the version string
+        UStartProgramCompile(entry);
+        return UPollShaderProgram(entry, wait);
+    }
 
-        if (channels == 3)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB8, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, image);
-        else if (channels == 4)
-            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, image);
-        else
+    if (success)
+    {
+        if (entry.fromBinary)
+            cout << "INFO: Loaded program binary " << UProgramCachePath(entry.cacheKey) << endl;
+        else if (gHasProgramBinary)
+            USaveProgramBinary(entry.cacheKey, entry.program);
+
+        UReflectShaderProgram(entry.program);
+
+        // We set the texture as texture unit 0
+        glProgramUniform1i(entry.program, UUniform(entry.program, UNIFORM_TEXTURE), 0);
+
+        entry.state = PROGRAM_READY;
+    }
+    else
+    {
+        // check for shader compile errors before blaming the link
+        glGetShaderiv(entry.vertexShader, GL_COMPILE_STATUS, &success);
+        if (!success)
         {
-            cout << "Not implemented to handle image with " << channels << " channels" << endl;
-            return false;
+            glGetShaderInfoLog(entry.vertexShader, sizeof(infoLog), NULL, infoLog);
+            std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
         }
 
-        glGenerateMipmap(GL_TEXTURE_2D);
+        glGetShaderiv(entry.fragmentShader, GL_COMPILE_STATUS, &success);
+        if (!success)
+        {
+            glGetShaderInfoLog(entry.fragmentShader, sizeof(infoLog), NULL, infoLog);
+            std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+        }
 
-        stbi_image_free(image);
-        glBindTexture(GL_TEXTURE_2D, 0); // Unbind the texture
+        glGetProgramInfoLog(entry.program, sizeof(infoLog), NULL, infoLog);
+        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
 
-        return true;
+        entry.state = PROGRAM_FAILED;
+    }
+    USetDrawProgram(entry.program, entry.state == PROGRAM_READY ? entry.program : gFallbackProgramId);
+
+    // The linked program no longer needs its shader objects
+    if (entry.vertexShader)
+    {
+        glDetachShader(entry.program, entry.vertexShader);
+        glDetachShader(entry.program, entry.fragmentShader);
+        glDeleteShader(entry.vertexShader);
+        glDeleteShader(entry.fragmentShader);
+        entry.vertexShader = 0;
+        entry.fragmentShader = 0;
     }
 
-    // Error loading the image
-    return false;
+    return entry.state;
 }
 
-// Destroy mesh
-void UDestroyMesh(GLMesh& mesh)
+// The program to draw with: the requested one once it has linked, the fallback until then (or if it failed).
+// A table read, so every draw can call it; the link status is polled once per frame in UResolveShaderPrograms
+GLuint UReadyProgram(GLuint programId)
 {
-    glDeleteVertexArrays(1, &mesh.vao);
-    glDeleteBuffers(1, &mesh.vbo);
+    return programId < gDrawPrograms.size() ? gDrawPrograms[programId] : programId;
 }
 
+void USetDrawProgram(GLuint programId, GLuint drawProgramId)
+{
+    // Ids no program was registered under draw as themselves
+    while (gDrawPrograms.size() <= programId)
+        gDrawPrograms.push_back((GLuint)gDrawPrograms.size());
+    gDrawPrograms[programId] = drawProgramId;
+}
 
-// Destroy Texture
-void UDestroyTexture(GLuint textureId)
+// Poll the programs still compiling, without waiting; the ones that finished switch from the fallback
+void UResolveShaderPrograms()
 {
-    glGenTextures(1, &textureId);
+    for (ShaderProgram& entry : gShaderPrograms)
+    {
+        if (entry.state == PROGRAM_COMPILING)
+            UPollShaderProgram(entry, false);
+    }
 }
 
-// Implements the UCreateShaders function
-bool UCreateShaderProgram(const char* vtxShaderSource, const char* fragShaderSource, GLuint& programId)
+// Wait for every pending program; false if any of them failed
+bool UFinishShaderPrograms()
 {
-    // Compilation and linkage error reporting
-    int success = 0;
-    char infoLog[512];
+    bool success = true;
+    for (ShaderProgram& entry : gShaderPrograms)
+        success = UPollShaderProgram(entry, true) == PROGRAM_READY && success;
+    return success;
+}
 
-    // Create a Shader program object.
-    programId = glCreateProgram();
+// FNV-1a over both sources and the driver strings; a driver update changes the key
+uint64_t UProgramCacheKey(const char* vtxShaderSource, const char* fragShaderSource)
+{
+    const char* parts[] = {
+        vtxShaderSource,
+        fragShaderSource,
+        (const char*)glGetString(GL_VENDOR),
+        (const char*)glGetString(GL_RENDERER),
+        (const char*)glGetString(GL_VERSION)
+    };
 
-    // Create the vertex and fragment shader objects
-    GLuint vertexShaderId = glCreateShader(GL_VERTEX_SHADER);
-    GLuint fragmentShaderId = glCreateShader(GL_FRAGMENT_SHADER);
+    uint64_t key = 14695981039346656037ull;
+    for (const char* part : parts)
+    {
+        // The terminator is hashed too, so moving text between parts changes the key
+        for (const char* c = part ? part : ""; ; ++c)
+        {
+            key = (key ^ (unsigned char)*c) * 1099511628211ull;
+            if (*c == '\0')
+                break;
+        }
+    }
+    return key;
+}
 
-    // Retrive the shader source
-    glShaderSource(vertexShaderId, 1, &vtxShaderSource, NULL);
-    glShaderSource(fragmentShaderId, 1, &fragShaderSource, NULL);
+std::string UProgramCachePath(uint64_t key)
+{
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)key);
+    return std::string(SHADER_CACHE_PREFIX) + hex + ".bin";
+}
 
-    // Compile the vertex shader, and print compilation errors (if any)
-    glCompileShader(vertexShaderId); // compile the vertex shader
-    // check for shader compile errors
-    glGetShaderiv(vertexShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(vertexShaderId, 512, NULL, infoLog);
-        std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+// Create a program from a cached binary; fails (and the caller compiles) when the file is missing or stale.
+// Whether the driver accepts the binary is checked later, together with the link status of compiled programs
+bool ULoadProgramBinary(uint64_t key, GLuint& programId)
+{
+    std::ifstream file(UProgramCachePath(key), std::ios::binary);
+    if (!file)
+        return false;
 
+    ProgramCacheHeader header;
+    if (!file.read((char*)&header, sizeof(header)) || memcmp(header.magic, "UPGB", 4) != 0
+        || header.version != PROGRAM_CACHE_VERSION || header.key != key)
         return false;
-    }
 
-    glCompileShader(fragmentShaderId); // compile the fragment shader
-    // check for shader compile errors
-    glGetShaderiv(fragmentShaderId, GL_COMPILE_STATUS, &success);
-    if (!success)
-    {
-        glGetShaderInfoLog(fragmentShaderId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+    // A truncated or corrupt file can claim any length; check it against what is left before allocating
+    const std::streampos binaryStart = file.tellg();
+    file.seekg(0, std::ios::end);
+    const std::streamoff remaining = file.tellg() - binaryStart;
+    if (header.length == 0 || remaining < (std::streamoff)header.length)
+        return false;
+    file.seekg(binaryStart);
 
+    std::vector<char> binary(header.length);
+    if (!file.read(binary.data(), binary.size()))
         return false;
-    }
 
-    // Attached compiled shaders to the shader program
-    glAttachShader(programId, vertexShaderId);
-    glAttachShader(programId, fragmentShaderId);
+    programId = glCreateProgram();
+    glProgramBinary(programId, header.binaryFormat, binary.data(), (GLsizei)binary.size());
+    return true;
+}
 
-    glLinkProgram(programId);   // links the shader program
-    // check for linking errors
-    glGetProgramiv(programId, GL_LINK_STATUS, &success);
-    if (!success)
-    {
-        glGetProgramInfoLog(programId, sizeof(infoLog), NULL, infoLog);
-        std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+// Write the linked program's binary so the next run can skip compilation
+void USaveProgramBinary(uint64_t key, GLuint programId)
+{
+    GLint length = 0;
+    glGetProgramiv(programId, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+        return;
 
-        return false;
-    }
+    std::vector<char> binary(length);
+    GLenum binaryFormat = 0;
+    glGetProgramBinary(programId, length, &length, &binaryFormat, binary.data());
 
-    glUseProgram(programId);    // Uses the shader program
+    ProgramCacheHeader header = { { 'U', 'P', 'G', 'B' }, PROGRAM_CACHE_VERSION, key, binaryFormat, (uint32_t)length };
 
-    return true;
+    std::ofstream file(UProgramCachePath(key), std::ios::binary | std::ios::trunc);
+    if (!file.write((const char*)&header, sizeof(header)) || !file.write(binary.data(), length))
+        cout << "WARNING: Could not write program binary " << UProgramCachePath(key) << endl; // Next run compiles again
 }
 
 // End shader program
 void UDestroyShaderProgram(GLuint programId)
 {
+    for (size_t i = 0; i < gShaderPrograms.size(); ++i)
+    {
+        if (gShaderPrograms[i].program == programId)
+        {
+            if (gShaderPrograms[i].vertexShader)
+            {
+                glDeleteShader(gShaderPrograms[i].vertexShader);
+                glDeleteShader(gShaderPrograms[i].fragmentShader);
+            }
+            gShaderPrograms.erase(gShaderPrograms.begin() + i);
+            USetDrawProgram(programId, programId);
+            break;
+        }
+    }
+
+    if (programId < gShaderReflections.size())
+        std::fill(gShaderReflections[programId].locations, gShaderReflections[programId].locations + UNIFORM_COUNT, -1);
+
     glDeleteProgram(programId);
 }
 
+// Enumerate the active uniforms of a linked program and cache the locations the draw code uses
+void UReflectShaderProgram(GLuint programId)
+{
+    if (programId >= gShaderReflections.size())
+        gShaderReflections.resize(programId + 1);
+
+    ShaderReflection& reflection = gShaderReflections[programId];
+    std::fill(reflection.locations, reflection.locations + UNIFORM_COUNT, -1);
+
+    GLint uniformCount = 0;
+    glGetProgramiv(programId, GL_ACTIVE_UNIFORMS, &uniformCount);
+
+    for (GLint i = 0; i < uniformCount; ++i)
+    {
+        char name[256];
+        GLsizei length = 0;
+        GLint size = 0;
+        GLenum type = 0;
+        glGetActiveUniform(programId, i, sizeof(name), &length, &size, &type, name);
+
+        // Arrays are reported as "name[0]"
+        char* bracket = strchr(name, '[');
+        if (bracket)
+            *bracket = '\0';
+
+        for (int id = 0; id < UNIFORM_COUNT; ++id)
+        {
+            if (strcmp(name, UNIFORM_NAMES[id]) == 0)
+                reflection.locations[id] = glGetUniformLocation(programId, name);
+        }
+    }
+}
+
+// Cached location of a uniform in a program
+GLint UUniform(GLuint programId, UniformId uniform)
+{
+    return gShaderReflections[programId].locations[uniform];
+}
+